@@ -0,0 +1,121 @@
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+//
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+//
+#include <lyrahgames/buddy_system/buddy_system.hpp>
+
+using namespace std;
+using namespace lyrahgames;
+
+// Hardware counter for cache misses based on perf_event_open.
+// If the counter is not available, all measured values are zero.
+class cache_miss_counter {
+ public:
+  cache_miss_counter() {
+#if defined(__linux__)
+    perf_event_attr attr{};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+  ~cache_miss_counter() {
+#if defined(__linux__)
+    if (fd >= 0) close(fd);
+#endif
+  }
+
+  bool available() const noexcept { return fd >= 0; }
+
+  void start() noexcept {
+#if defined(__linux__)
+    if (fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+  }
+
+  uint64_t stop() noexcept {
+    uint64_t result = 0;
+#if defined(__linux__)
+    if (fd < 0) return 0;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &result, sizeof(result)) != sizeof(result)) result = 0;
+#endif
+    return result;
+  }
+
+ private:
+  int fd = -1;
+};
+
+int main() {
+  constexpr size_t operations = 1'000'000;
+  constexpr size_t max_live_allocations = 100'000;
+
+  // Same arena and allocation sizes as used in 'random.cpp'.
+  buddy_system::arena arena{size_t{1} << 32};  // 4 GiB
+  mt19937 rng{1234};
+  uniform_int_distribution<int> mem_exp_dist{4, 20};
+
+  // Precompute all random decisions to only measure the arena.
+  vector<size_t> sizes(operations);
+  vector<size_t> indices(operations);
+  for (size_t i = 0; i < operations; ++i) {
+    sizes[i] = (size_t{1} << mem_exp_dist(rng)) - 8;
+    indices[i] = rng();
+  }
+  vector<void*> pointers{};
+  pointers.reserve(max_live_allocations);
+
+  cache_miss_counter counter{};
+  size_t mallocs = 0;
+  size_t frees = 0;
+  const auto start = chrono::high_resolution_clock::now();
+  counter.start();
+  for (size_t i = 0; i < operations; ++i) {
+    if (pointers.empty() ||
+        ((pointers.size() < max_live_allocations) && (indices[i] & 1))) {
+      const auto p = arena.malloc(sizes[i]);
+      if (p) pointers.push_back(p);
+      ++mallocs;
+    } else {
+      const auto index = (indices[i] >> 1) % pointers.size();
+      arena.free(pointers[index]);
+      pointers[index] = pointers.back();
+      pointers.pop_back();
+      ++frees;
+    }
+  }
+  const auto misses = counter.stop();
+  const auto end = chrono::high_resolution_clock::now();
+  for (auto p : pointers) arena.free(p);
+
+  const auto time = chrono::duration<double>(end - start).count();
+  cout << "operations          = " << setw(15) << operations << '\n'
+       << "mallocs             = " << setw(15) << mallocs << '\n'
+       << "frees               = " << setw(15) << frees << '\n'
+       << "time                = " << setw(15) << time << " s" << '\n'
+       << "time per operation  = " << setw(15) << time / operations * 1e9
+       << " ns" << '\n';
+  if (counter.available())
+    cout << "cache misses        = " << setw(15) << misses << '\n'
+         << "misses per operation= " << setw(15)
+         << double(misses) / operations << '\n';
+  else
+    cout << "cache misses        = " << setw(15) << "not available" << '\n';
+}
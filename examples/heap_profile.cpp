@@ -0,0 +1,87 @@
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+//
+#include <lyrahgames/buddy_system/buddy_system.hpp>
+
+using namespace std;
+using namespace lyrahgames;
+
+// Two allocation sites with different sizes to be found in the heap profile.
+__attribute__((noinline)) void allocate_messages(buddy_system::arena& arena,
+                                                 vector<void*>& pointers) {
+  for (size_t i = 0; i < 10'000; ++i) pointers.push_back(arena.malloc(1000));
+}
+__attribute__((noinline)) void allocate_images(buddy_system::arena& arena,
+                                               vector<void*>& pointers) {
+  for (size_t i = 0; i < 100; ++i) pointers.push_back(arena.malloc(100'000));
+}
+
+// Random allocations and deallocations of sizes up to 2^max_exp bytes.
+double workload(buddy_system::arena& arena, int max_exp) {
+  constexpr size_t operations = 2'000'000;
+  constexpr size_t max_live_allocations = 10'000;
+  mt19937 rng{1234};
+  uniform_int_distribution<int> mem_exp_dist{4, max_exp};
+  vector<void*> pointers{};
+  pointers.reserve(max_live_allocations);
+  const auto start = chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < operations; ++i) {
+    const auto r = rng();
+    if (pointers.empty() ||
+        ((pointers.size() < max_live_allocations) && (r & 1))) {
+      const auto p = arena.malloc((size_t{1} << mem_exp_dist(rng)) - 8);
+      if (p) pointers.push_back(p);
+    } else {
+      const auto index = (r >> 1) % pointers.size();
+      arena.free(pointers[index]);
+      pointers[index] = pointers.back();
+      pointers.pop_back();
+    }
+  }
+  const auto end = chrono::high_resolution_clock::now();
+  for (auto p : pointers) arena.free(p);
+  return chrono::duration<double>(end - start).count();
+}
+
+int main() {
+  buddy_system::arena arena{size_t{1} << 30};
+
+  // Measure the overhead of sampling with the default sample interval. The
+  // more bytes are allocated per second, the more samples have to be taken.
+  // The fastest of several rounds is less sensitive to noise.
+  for (auto max_exp : {10, 16}) {
+    double plain = numeric_limits<double>::infinity();
+    double profiled = numeric_limits<double>::infinity();
+    for (size_t round = 0; round < 10; ++round) {
+      plain = min(plain, workload(arena, max_exp));
+      arena.start_profiling();
+      profiled = min(profiled, workload(arena, max_exp));
+      arena.stop_profiling();
+    }
+    cout << "allocation sizes       = " << setw(15)
+         << (size_t{1} << max_exp) << " B at most" << '\n'
+         << "time without profiling = " << setw(15) << plain << " s" << '\n'
+         << "time with profiling    = " << setw(15) << profiled << " s" << '\n'
+         << "overhead               = " << setw(15)
+         << (profiled / plain - 1) * 100 << " %" << '\n'
+         << '\n';
+  }
+
+  // Keep some live allocations and dump the profile. Only 20 MB are allocated.
+  // So a smaller sample interval is used to get a detailed profile.
+  arena.start_profiling(size_t{1} << 16);
+  vector<void*> pointers{};
+  pointers.reserve(20'000);
+  allocate_messages(arena, pointers);
+  allocate_images(arena, pointers);
+  arena.write_heap_profile(cout, buddy_system::profile_format::text);
+  // Use 'pprof --text <executable> heap.prof' to analyze the profile.
+  ofstream file{"heap.prof"};
+  arena.write_heap_profile(file);
+  for (auto p : pointers) arena.free(p);
+}
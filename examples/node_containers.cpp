@@ -0,0 +1,120 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <random>
+#include <unordered_map>
+#include <vector>
+//
+#include <lyrahgames/buddy_system/buddy_system.hpp>
+
+using namespace std;
+using namespace lyrahgames;
+
+// Allocator without object pools. Like buddy_system::allocator before the
+// pools were introduced, it takes a page of the arena for every node.
+template <typename T>
+struct page_allocator {
+  using value_type = T;
+
+  page_allocator(buddy_system::arena& a) noexcept : handle{a} {}
+  template <typename U>
+  page_allocator(const page_allocator<U>& other) noexcept
+      : handle{other.handle} {}
+
+  T* allocate(size_t n) {
+    return reinterpret_cast<T*>(handle.allocate(n * sizeof(T)));
+  }
+  void deallocate(T* ptr, size_t) noexcept { handle.deallocate(ptr); }
+
+  buddy_system::arena& handle;
+};
+
+template <typename T, typename U>
+inline bool operator==(const page_allocator<T>& x,
+                       const page_allocator<U>& y) noexcept {
+  return &x.handle == &y.handle;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const page_allocator<T>& x,
+                       const page_allocator<U>& y) noexcept {
+  return !(x == y);
+}
+
+template <typename T, template <typename> typename Allocator>
+using my_list = list<T, Allocator<T>>;
+template <typename K, typename V, template <typename> typename Allocator>
+using my_map = map<K, V, less<K>, Allocator<pair<const K, V>>>;
+template <typename K, typename V, template <typename> typename Allocator>
+using my_unordered_map =
+    unordered_map<K, V, hash<K>, equal_to<K>, Allocator<pair<const K, V>>>;
+
+constexpr size_t element_count = 200'000;
+constexpr size_t rounds = 5;
+
+// Measure the time needed to insert and erase random keys in a node container.
+template <typename Container, typename Insert, typename Erase>
+double benchmark(Container& c, Insert insert, Erase erase) {
+  mt19937 rng{1234};
+  vector<int> keys(element_count);
+  for (auto& k : keys) k = rng();
+
+  const auto start = chrono::high_resolution_clock::now();
+  for (size_t r = 0; r < rounds; ++r) {
+    for (auto k : keys) insert(c, k);
+    for (auto k : keys) erase(c, k);
+  }
+  const auto end = chrono::high_resolution_clock::now();
+  return chrono::duration<double>(end - start).count();
+}
+
+// The speedups of the object pools are given relative to std::allocator and
+// to the allocation of a page for every node.
+void print(const char* name, double std_time, double page_time,
+           double object_time) {
+  cout << setw(14) << name << setw(14) << std_time << " s" << setw(14)
+       << page_time << " s" << setw(14) << object_time << " s" << setw(9)
+       << std_time / object_time << setw(9) << page_time / object_time
+       << '\n';
+}
+
+int main() {
+  buddy_system::arena arena{size_t{1} << 30};
+
+  const auto list_insert = [](auto& c, int k) { c.push_back(k); };
+  const auto list_erase = [](auto& c, int) { c.pop_front(); };
+  const auto map_insert = [](auto& c, int k) { c.emplace(k, k); };
+  const auto map_erase = [](auto& c, int k) { c.erase(k); };
+
+  cout << setw(14) << "container" << setw(16) << "std::allocator"
+       << setw(16) << "pages" << setw(16) << "objects" << setw(9) << "vs std"
+       << setw(9) << "vs pages" << '\n'
+       << setfill('-') << setw(80) << '\n'
+       << setfill(' ');
+  {
+    list<int> a{};
+    my_list<int, page_allocator> b{arena};
+    my_list<int, buddy_system::allocator> c{arena};
+    print("list", benchmark(a, list_insert, list_erase),
+          benchmark(b, list_insert, list_erase),
+          benchmark(c, list_insert, list_erase));
+  }
+  {
+    map<int, int> a{};
+    my_map<int, int, page_allocator> b{arena};
+    my_map<int, int, buddy_system::allocator> c{arena};
+    print("map", benchmark(a, map_insert, map_erase),
+          benchmark(b, map_insert, map_erase),
+          benchmark(c, map_insert, map_erase));
+  }
+  {
+    unordered_map<int, int> a{};
+    my_unordered_map<int, int, page_allocator> b{arena};
+    my_unordered_map<int, int, buddy_system::allocator> c{arena};
+    print("unordered_map", benchmark(a, map_insert, map_erase),
+          benchmark(b, map_insert, map_erase),
+          benchmark(c, map_insert, map_erase));
+  }
+}
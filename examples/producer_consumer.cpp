@@ -0,0 +1,99 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+//
+#include <lyrahgames/buddy_system/buddy_system.hpp>
+
+using namespace std;
+using namespace lyrahgames;
+
+constexpr size_t pairs = 4;
+constexpr size_t message_count = 500'000;
+
+// Bounded single-producer single-consumer queue to pass the messages.
+class message_queue {
+ public:
+  bool push(void* message) noexcept {
+    const auto t = tail.load(memory_order_relaxed);
+    if (t - head.load(memory_order_acquire) == capacity) return false;
+    buffer[t % capacity] = message;
+    tail.store(t + 1, memory_order_release);
+    return true;
+  }
+  void* pop() noexcept {
+    const auto h = head.load(memory_order_relaxed);
+    if (h == tail.load(memory_order_acquire)) return nullptr;
+    const auto message = buffer[h % capacity];
+    head.store(h + 1, memory_order_release);
+    return message;
+  }
+
+ private:
+  static constexpr size_t capacity = 1024;
+  void* buffer[capacity]{};
+  alignas(64) atomic<size_t> head{};
+  alignas(64) atomic<size_t> tail{};
+};
+
+// Every producer allocates messages which are freed by its consumer. With
+// remote frees, consumers push the messages to the queue of their producer
+// instead of locking the arena.
+double benchmark(bool remote) {
+  buddy_system::arena arena{size_t{1} << 30};
+  vector<unique_ptr<buddy_system::remote_free_queue>> owners{};
+  vector<unique_ptr<message_queue>> queues{};
+  for (size_t i = 0; i < pairs; ++i) {
+    owners.push_back(make_unique<buddy_system::remote_free_queue>(arena));
+    queues.push_back(make_unique<message_queue>());
+  }
+
+  const auto start = chrono::high_resolution_clock::now();
+  vector<thread> threads{};
+  for (size_t i = 0; i < pairs; ++i) {
+    threads.emplace_back([&, i] {
+      mt19937 rng{unsigned(i)};
+      uniform_int_distribution<size_t> size_dist{64, 4096};
+      for (size_t j = 0; j < message_count; ++j) {
+        const auto size = size_dist(rng);
+        void* message;
+        while (!(message = remote ? owners[i]->malloc(size)
+                                  : arena.malloc(size)))
+          this_thread::yield();
+        memset(message, int(j), 64);
+        while (!queues[i]->push(message)) this_thread::yield();
+      }
+    });
+    threads.emplace_back([&, i] {
+      for (size_t j = 0; j < message_count; ++j) {
+        void* message;
+        while (!(message = queues[i]->pop())) this_thread::yield();
+        if (remote)
+          owners[i]->push(message);
+        else
+          arena.free(message);
+      }
+    });
+  }
+  for (auto& t : threads) t.join();
+  const auto end = chrono::high_resolution_clock::now();
+  return chrono::duration<double>(end - start).count();
+}
+
+int main() {
+  const auto locked = benchmark(false);
+  const auto remote = benchmark(true);
+  const auto total = double(pairs * message_count);
+  cout << "producer/consumer pairs = " << setw(15) << pairs << '\n'
+       << "messages per pair       = " << setw(15) << message_count << '\n'
+       << "locked free             = " << setw(15) << total / locked / 1e6
+       << " M messages/s" << '\n'
+       << "remote free queue       = " << setw(15) << total / remote / 1e6
+       << " M messages/s" << '\n'
+       << "speedup                 = " << setw(15) << locked / remote << '\n';
+}
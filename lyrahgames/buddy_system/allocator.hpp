@@ -18,14 +18,38 @@ struct allocator {
   template <typename U>
   allocator(const allocator<U>& other) noexcept : handle{other.handle} {}
 
+  // Single objects, as used by node-based containers, are taken from the
+  // object pools of the arena. The standard guarantees that deallocate is
+  // called with the same count as allocate.
   T* allocate(size_t n) {
+    if (n == 1) {
+      const auto result = handle.malloc_object<sizeof(T), alignof(T)>();
+      if (!result) throw std::bad_alloc{};
+      return reinterpret_cast<T*>(result);
+    }
     return reinterpret_cast<T*>(handle.allocate(n * sizeof(T)));
   }
   void deallocate(T* ptr, size_t n) noexcept {
+    if (n == 1) {
+      handle.free_object<sizeof(T), alignof(T)>(reinterpret_cast<void*>(ptr));
+      return;
+    }
     handle.deallocate(reinterpret_cast<void*>(ptr));
   }
 
   arena& handle;
 };
 
+// Two allocators are equal if they use the same arena. Then memory allocated
+// by one of them can be deallocated by the other one.
+template <typename T, typename U>
+inline bool operator==(const allocator<T>& x, const allocator<U>& y) noexcept {
+  return &x.handle == &y.handle;
+}
+
+template <typename T, typename U>
+inline bool operator!=(const allocator<T>& x, const allocator<U>& y) noexcept {
+  return !(x == y);
+}
+
 }  // namespace lyrahgames::buddy_system
\ No newline at end of file
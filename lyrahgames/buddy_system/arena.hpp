@@ -1,8 +1,14 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <limits>
 #include <utility>
 //
 #include <iomanip>
@@ -10,10 +16,18 @@
 //
 #include <new>
 #include <stdexcept>
-#include <vector>
 //
 #include <mutex>
+#include <unordered_map>
 //
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+//
+#include <lyrahgames/buddy_system/bitmap.hpp>
+#include <lyrahgames/buddy_system/hardening.hpp>
+#include <lyrahgames/buddy_system/profiler.hpp>
 #include <lyrahgames/buddy_system/utility.hpp>
 
 namespace lyrahgames::buddy_system {
@@ -22,13 +36,26 @@ namespace lyrahgames::buddy_system {
 // allocated on the heap. It provides bare-bones allocation and deallocation
 // functions and will accessed by an allocator which acts as a handle to the
 // buddy system algorithms.
+// Free pages are not linked through the managed memory. Instead, every page
+// size owns a hierarchical bitmap of its free pages which is stored densely
+// behind the managed memory. So splitting, merging and popping pages only
+// touch this metadata and never the memory of the pages themselves.
+class remote_free_queue;
+
 class arena {
   struct node {
     node* next{};
   };
 
  public:
+  static constexpr size_t page_alignment{64};
+
   explicit arena(size_t);
+  // Manage the given memory without taking its ownership. The memory also
+  // contains the metadata of the arena. Only the largest power of two fitting
+  // into the memory will be used as managed memory. To manage a given size,
+  // provide at least required_memory_size(size) bytes.
+  arena(void* memory, size_t size);
   ~arena();
   arena(arena&) = delete;
   arena& operator=(arena&) = delete;
@@ -45,6 +72,61 @@ class arena {
   }
   void deallocate(void* address) noexcept { free(address); }
 
+  // Deferred deallocation moves the expensive merging of buddies out of free.
+  // Freed pages are only pushed to a lock-free list of pending pages and are
+  // merged later by maintain or when an allocation could not be served.
+  void set_deferred_free(bool enable) noexcept {
+    deferred_free.store(enable, std::memory_order_relaxed);
+  }
+  bool is_deferring_free() const noexcept {
+    return deferred_free.load(std::memory_order_relaxed);
+  }
+  // Merge pending pages, give pages of object pools without live objects back
+  // and return the memory of free pages of at least 2 MiB to the operating
+  // system. Stop as soon as the given time budget is
+  // exceeded. The next call continues where the last one stopped. Returns true
+  // if there is still work left. The memory is returned without holding the
+  // lock of the arena. An allocation that needs the affected free page
+  // interrupts the purge and waits until the page is free again.
+  bool maintain(std::chrono::nanoseconds budget) noexcept;
+
+  // The opt-in heap profiler samples allocations to find out which code paths
+  // own the live memory. Without profiling, allocations only check a pointer.
+  // Stopping keeps the samples of live allocations.
+  void start_profiling(
+      size_t sample_interval = heap_profiler::default_sample_interval);
+  void stop_profiling() noexcept;
+  bool is_profiling() const noexcept {
+    const auto p = profiler.load(std::memory_order_acquire);
+    return p && p->is_sampling();
+  }
+  void write_heap_profile(std::ostream& os,
+                          profile_format format = profile_format::pprof) const;
+
+  // Allocations larger than the threshold bypass the buddy system and are
+  // directly mapped from the operating system with a size rounded up to the
+  // next system page. So large blocks do not waste up to half of their page
+  // and do not block the managed memory. free, page_size, usable_size and
+  // is_valid recognize them. By default, all allocations use the buddy system.
+  void set_large_allocation_threshold(size_t size) noexcept {
+    large_threshold.store(size, std::memory_order_relaxed);
+  }
+  size_t large_allocation_threshold() const noexcept {
+    return large_threshold.load(std::memory_order_relaxed);
+  }
+
+  // Allocate and deallocate single objects whose size and alignment are known
+  // at compile time. Small objects are taken from a free list of equally sized
+  // slots inside of pages allocated by the arena. Hence, they need no header
+  // and no size computation at runtime. Memory allocated by malloc_object has
+  // to be deallocated by free_object with the same template arguments. Pool
+  // pages without live objects are given back by maintain or when an
+  // allocation would fail otherwise.
+  template <size_t size, size_t alignment>
+  void* malloc_object() noexcept;
+  template <size_t size, size_t alignment>
+  void free_object(void* address) noexcept;
+
   size_t min_page_size() const noexcept {
     return size_t{1} << min_page_size_exp;
   }
@@ -52,14 +134,22 @@ class arena {
     return size_t{1} << max_page_size_exp;
   }
   size_t page_size(void* ptr) const noexcept {
-    return size_t{1} << (reinterpret_cast<size_t>(
-                             (reinterpret_cast<node*>(ptr) - 1)->next) +
-                         min_page_size_exp);
+    if (!contains(ptr)) return large_block_size(ptr);
+    return size_t{1}
+           << (page_index(reinterpret_cast<node*>(ptr) - 1) + min_page_size_exp);
   }
   size_t managed_memory_size() const noexcept {
     return size_t{1} << max_page_size_exp;
   }
   size_t reserved_memory_size() const noexcept { return memory_size; }
+  // Amount of memory that is needed to manage the given size.
+  static size_t required_memory_size(size_t size) noexcept {
+    const auto exp = (size <= 1) ? default_min_page_size_exp
+                                 : std::max(default_min_page_size_exp,
+                                            size_t(log2(size - 1) + 1));
+    return page_alignment + (size_t{1} << exp) +
+           metadata_size(exp, default_min_page_size_exp);
+  }
   size_t available_memory_size() const noexcept;
   size_t max_available_page_size() const noexcept;
   auto index_of_node_ptr(node* ptr) const noexcept {
@@ -77,20 +167,214 @@ class arena {
   auto next_size_exp(size_t size) const noexcept {
     return std::max(min_page_size_exp, size_t(log2(size - 1) + 1));
   }
+  // Page size which would be used to allocate the given amount of bytes.
+  size_t page_size_for(size_t size) const noexcept {
+    return size_t{1}
+           << next_size_exp(size + page_header_size + page_footer_size);
+  }
+  // Amount of bytes the user is allowed to use for an allocated page.
+  size_t usable_size(void* ptr) const noexcept {
+    // Large blocks have no header and no footer.
+    if (!contains(ptr)) return large_block_size(ptr);
+    return page_size(ptr) - page_header_size - page_footer_size;
+  }
+  // Check whether the address lies in the managed memory of the arena.
+  bool contains(const void* ptr) const noexcept {
+    const auto offset =
+        static_cast<size_t>(reinterpret_cast<const std::byte*>(ptr) -
+                            reinterpret_cast<const std::byte*>(base));
+    return offset < managed_memory_size();
+  }
   bool is_valid(void* ptr) const noexcept;
+  // Walk through the whole managed memory and verify the structure of the
+  // buddy system: pages of all levels do not overlap, no two free buddies are
+  // left unmerged, all allocated page headers are valid, and free plus
+  // allocated bytes add up to the managed memory size. Pages that are pending
+  // due to deferred deallocation count as allocated. Meant for tests. The
+  // arena is locked during the check but deferred frees and object pools must
+  // not be used concurrently.
+  bool check_invariants() const noexcept;
+
+  // The arena fulfills the requirements of Lockable. Locking it blocks all
+  // allocations and deallocations. This is needed, for example, to keep the
+  // arena consistent when a process is forked.
+  void lock() const { mutex.lock(); }
+  bool try_lock() const { return mutex.try_lock(); }
+  void unlock() const { mutex.unlock(); }
 
   friend std::ostream& operator<<(std::ostream&, const arena&);
+  friend class remote_free_queue;
 
  private:
+  // Decode and encode the size index stored in the header of an allocated
+  // page. In hardened mode, the header is additionally tagged with a magic
+  // number to detect corrupted headers as well as double frees.
+  size_t page_index(const node* page) const noexcept;
+  void set_page_index(node* page, size_t index) noexcept;
+  // Sampled pages are marked in their header to not look up every free.
+  bool is_sampled(const node* page) const noexcept {
+    return reinterpret_cast<size_t>(page->next) & sampled_page_flag;
+  }
+  void sample_page(node* page, void* address, size_t size) noexcept;
+  void forget_sample(node* page, void* address) noexcept {
+    if (is_sampled(page))
+      profiler.load(std::memory_order_acquire)->remove(address);
+  }
+  // Slots of object pools are sampled one by one. Their pool page is marked
+  // if it contains sampled slots. Other threads may mark the page at the same
+  // time. So its header is accessed atomically.
+  void sample_slot(void* address, size_t size, size_t slot_size) noexcept;
+  void forget_slot_sample(void* address) noexcept;
+  size_t* object_pool_header(void* slot) const noexcept {
+    return reinterpret_cast<size_t*>(&object_pool_page_of(slot)->next);
+  }
+  // Hardened mode only: helpers for the canary at the end of each page.
+  size_t* page_canary(node* page, size_t index) const noexcept;
+  size_t canary_value(const node* page) const noexcept;
+  [[noreturn]] void report_invalid_free(void* address) const noexcept;
+  void init_free_pages();
+  size_t page_levels() const noexcept {
+    return max_page_size_exp - min_page_size_exp + 1;
+  }
+  // Size of all bitmaps for free pages and dirty chunks in bytes.
+  static size_t metadata_size(size_t max_exp, size_t min_exp) noexcept {
+    size_t words = hierarchical_bitmap::words_for(purge_chunk_count(max_exp));
+    for (auto exp = min_exp; exp <= max_exp; ++exp)
+      words += hierarchical_bitmap::words_for(size_t{1} << (max_exp - exp));
+    return words * sizeof(hierarchical_bitmap::word);
+  }
+  static size_t purge_chunk_count(size_t max_exp) noexcept {
+    return (max_exp > purge_chunk_size_exp)
+               ? (size_t{1} << (max_exp - purge_chunk_size_exp))
+               : 1;
+  }
+  bool purges_memory() const noexcept {
+    return max_page_size_exp >= purge_chunk_size_exp;
+  }
+  // Number of a page relative to all pages of the same size.
+  size_t page_number(const node* page, size_t index) const noexcept {
+    return static_cast<size_t>(page - base) * sizeof(node) >>
+           (index + min_page_size_exp);
+  }
+  node* page_of_number(size_t number, size_t index) const noexcept {
+    return base + ((number << (index + min_page_size_exp)) / sizeof(node));
+  }
+  // Allocate a page in the buddy system without sampling it.
+  node* malloc_page(size_t size) noexcept;
+  // The following functions require the mutex to be locked.
+  node* pop_page(size_t index) noexcept;
+  void merge_page(node* page, size_t index) noexcept;
+  void mark_dirty_chunks(size_t offset, size_t size) noexcept;
+  // Return the page of an allocated address and its size index. If the address
+  // cannot belong to an allocated page, nullptr is returned.
+  node* validated_page(void* address, size_t& index) const noexcept;
+  // Move a valid allocated page to the given lock-free list of pending pages.
+  void push_pending_page(std::atomic<node*>& list, node* page,
+                         size_t index) noexcept;
+  // Merge a list of pending pages until the given time point has been reached
+  // and return the pages that are left. Requires the mutex to be locked.
+  node* merge_page_list(
+      node* pages, std::chrono::steady_clock::time_point deadline =
+                       std::chrono::steady_clock::time_point::max()) noexcept;
+
+  // Directly mapped blocks for large allocations. The size of an unknown
+  // block is zero and freeing it returns false.
+  void* malloc_large(size_t size) noexcept;
+  bool free_large(void* address) noexcept;
+  size_t large_block_size(const void* address) const noexcept;
+  // Merge pending pages until the given time point has been reached.
+  bool merge_pending_pages(
+      std::chrono::steady_clock::time_point deadline) noexcept;
+  // Return the memory of dirty chunks inside of free pages to the operating
+  // system until the given time point has been reached.
+  bool purge_free_pages(
+      std::chrono::steady_clock::time_point deadline) noexcept;
+
+  // Free list of slots with a fixed size used for small objects. The header
+  // of each pool page counts its live slots in multiples of live_slot_unit.
+  // Pages without live slots are counted as empty.
+  struct object_pool {
+    std::mutex mutex{};
+    node* head{};
+    size_t empty_pages{};
+  };
+  static constexpr size_t object_granularity = alignof(node);
+  static constexpr size_t max_object_size = 256;
+  static constexpr size_t object_pool_page_size = 4096;
+  static constexpr size_t object_pool_fraction = 16;
+  static constexpr size_t object_slot_size(size_t size,
+                                           size_t alignment) noexcept {
+    const auto a = std::max(alignment, object_granularity);
+    return (std::max(size, sizeof(node)) + a - 1) & ~(a - 1);
+  }
+  bool refill_object_pool(object_pool& pool, size_t slot_size) noexcept;
+  // Remove all slots of empty pool pages from the free lists and merge these
+  // pages. Returns false if there was no empty page.
+  bool release_object_pools() noexcept;
+  // For small arenas, the page size is reduced to not let a single pool
+  // occupy all the memory.
+  size_t object_pool_page() const noexcept {
+    return std::max(min_page_size(),
+                    std::min(object_pool_page_size,
+                             max_page_size() / object_pool_fraction));
+  }
+  size_t object_pool_slots(size_t slot_size) const noexcept {
+    return (object_pool_page() - page_header_size - page_footer_size) /
+           slot_size;
+  }
+  node* object_pool_page_of(void* slot) const noexcept {
+    return base + (index_of_node_ptr(slot) & ~(object_pool_page() - 1)) /
+                      sizeof(node);
+  }
+
   static constexpr size_t page_header_size = alignof(node);
-  static constexpr size_t page_alignment{64};
+  static constexpr size_t page_footer_size = hardened ? sizeof(size_t) : 0;
+  static constexpr size_t allocated_page_magic = 0xb0dd1e5a110c0000;
+  static constexpr size_t freed_page_magic = 0xb0dd1e5f4eed0000;
+  static constexpr size_t page_magic_mask = ~size_t{0xffff};
+  static constexpr size_t sampled_page_flag = size_t{1} << 15;
+  static constexpr size_t page_index_mask = sampled_page_flag - 1;
+  static constexpr size_t live_slot_unit = size_t{1} << 16;
+  static constexpr size_t canary_magic = 0xca4a4901ca4a4901;
+  // Free memory is returned to the operating system in chunks of this size.
+  // A chunk becomes dirty when a page inside of it is allocated.
+  static constexpr size_t purge_chunk_size_exp = 21;
+  // Each call to madvise is restricted to this size to keep the time budget.
+  static constexpr size_t purge_slice_size = size_t{1} << 16;
+  // Number of pending pages or skipped chunks after which the time budget is
+  // checked again.
+  static constexpr size_t maintain_check_interval = 32;
+  static constexpr size_t default_min_page_size_exp = 6;
+  // Enough page sizes for a 64-bit address space.
+  static constexpr size_t max_page_levels = 64 - default_min_page_size_exp;
   size_t max_page_size_exp{};
-  size_t min_page_size_exp{6};
+  size_t min_page_size_exp{default_min_page_size_exp};
   size_t memory_size{};
   node* base{};
-  std::vector<node*> free_pages{};
+  std::array<hierarchical_bitmap, max_page_levels> free_pages{};
   std::byte* memory{};
+  bool owns_memory{};
   mutable std::mutex mutex;
+  std::atomic<bool> deferred_free{};
+  std::atomic<node*> pending_pages{};
+  // The following members are protected by the mutex. Pending pages that were
+  // not merged in time are kept for the next call to maintain. An interrupted
+  // purge continues at the given offset. The free page that is purged without
+  // holding the lock is neither allocated nor marked as free.
+  node* unmerged_pages{};
+  hierarchical_bitmap dirty_chunks{};
+  size_t purge_offset{};
+  node* purging_page{};
+  size_t purging_index{};
+  // Allocations set the flag to stop the purge and wait for its page.
+  std::atomic<bool> purge_interrupted{};
+  std::condition_variable purge_finished{};
+  std::array<object_pool, max_object_size / object_granularity>
+      object_pools{};
+  std::atomic<heap_profiler*> profiler{};
+  std::atomic<size_t> large_threshold{std::numeric_limits<size_t>::max()};
+  mutable std::mutex large_blocks_mutex{};
+  std::unordered_map<const void*, size_t> large_blocks{};
 };
 
 arena::arena(size_t s) {
@@ -103,87 +387,450 @@ arena::arena(size_t s) {
   max_page_size_exp = next_size_exp(s);
   const auto size = size_t{1} << max_page_size_exp;
 
-  // Allocate aligned system memory on the heap to be managed.
-  memory_size = size + page_alignment;
+  // Allocate aligned system memory on the heap to be managed. The metadata is
+  // placed behind the managed memory.
+  memory_size = required_memory_size(size);
   memory = new (std::align_val_t{page_alignment}) std::byte[memory_size];
+  owns_memory = true;
 
   // Base pointer is only 8-byte aligned but the actual returned memory pointers
   // will be 64-byte aligned.
   base = reinterpret_cast<node*>(memory + (page_alignment - page_header_size));
 
-  // Allocate free buddy list and initialize it.
-  free_pages =
-      decltype(free_pages)(max_page_size_exp - min_page_size_exp + 1, nullptr);
-  free_pages.back() = base;
-  free_pages.back()->next = nullptr;
+  init_free_pages();
+}
+
+inline arena::arena(void* m, size_t s)
+    : memory_size{s}, memory{reinterpret_cast<std::byte*>(m)} {
+  // Align the base pointer in the same way as above but inside the given
+  // memory. The remaining bytes determine the maximal page size.
+  const auto address = reinterpret_cast<uintptr_t>(memory) + page_header_size;
+  const auto offset =
+      ((address + page_alignment - 1) & ~(page_alignment - 1)) - address;
+  const auto reserved = offset + page_header_size;
+  if (!m || s <= reserved + min_page_size()) throw std::bad_alloc{};
+  base = reinterpret_cast<node*>(memory + offset);
+  // Reduce the managed size until the metadata fits as well.
+  max_page_size_exp = log2(s - reserved);
+  while ((max_page_size_exp > min_page_size_exp) &&
+         (reserved + managed_memory_size() +
+              metadata_size(max_page_size_exp, min_page_size_exp) >
+          s))
+    --max_page_size_exp;
+  if (reserved + managed_memory_size() +
+          metadata_size(max_page_size_exp, min_page_size_exp) >
+      s)
+    throw std::bad_alloc{};
+
+  init_free_pages();
+}
+
+inline void arena::init_free_pages() {
+  if (page_levels() > max_page_levels) throw std::bad_alloc{};
+  // The bitmaps start at the first cache line behind the managed memory.
+  auto words = reinterpret_cast<hierarchical_bitmap::word*>(
+      reinterpret_cast<std::byte*>(base) + managed_memory_size() +
+      page_header_size);
+  std::memset(words, 0, metadata_size(max_page_size_exp, min_page_size_exp));
+  for (size_t i = 0; i < page_levels(); ++i) {
+    const auto bits = size_t{1} << (page_levels() - 1 - i);
+    free_pages[i] = hierarchical_bitmap{words, bits};
+    words += hierarchical_bitmap::words_for(bits);
+  }
+  // Fresh memory is clean. So nothing has to be purged in the beginning.
+  dirty_chunks =
+      hierarchical_bitmap{words, purge_chunk_count(max_page_size_exp)};
+  // In the beginning, the whole memory is one free page.
+  free_pages[page_levels() - 1].set(0);
+
+  // The managed memory is only accessible after it has been allocated.
+  annotate_pool_creation(this);
+  poison_memory_region(base, managed_memory_size());
+}
+
+arena::~arena() {
+#if defined(__linux__)
+  for (const auto& [address, size] : large_blocks)
+    munmap(const_cast<void*>(address), size);
+#endif
+  delete profiler.load();
+  annotate_pool_destruction(this);
+  unpoison_memory_region(memory, memory_size);
+  if (!owns_memory) return;
+  // The memory was allocated with extended alignment and has to be
+  // deallocated with the same alignment.
+  operator delete[](memory, std::align_val_t{page_alignment});
+}
+
+inline size_t arena::page_index(const node* page) const noexcept {
+  const auto header = reinterpret_cast<size_t>(page->next);
+  if constexpr (hardened) {
+    // An invalid header results in an invalid index.
+    if ((header & page_magic_mask) != allocated_page_magic)
+      return page_levels();
+  }
+  // Pool pages store the number of their live slots above the index.
+  return header & page_index_mask;
+}
+
+inline void arena::set_page_index(node* page, size_t index) noexcept {
+  if constexpr (hardened) index |= allocated_page_magic;
+  page->next = reinterpret_cast<node*>(index);
+}
+
+inline size_t* arena::page_canary(node* page, size_t index) const noexcept {
+  return reinterpret_cast<size_t*>(
+      reinterpret_cast<std::byte*>(page) +
+      (size_t{1} << (index + min_page_size_exp)) - page_footer_size);
 }
 
-arena::~arena() { delete[] memory; }
+inline size_t arena::canary_value(const node* page) const noexcept {
+  // Mixing in the address makes canaries copied from other pages invalid.
+  return canary_magic ^ reinterpret_cast<size_t>(page);
+}
+
+inline void arena::report_invalid_free(void* address) const noexcept {
+  // This is only called in hardened mode after a free was found to be invalid.
+  // So we are allowed to spend some time on a more precise diagnosis.
+  const auto page = reinterpret_cast<node*>(address) - 1;
+  const auto memory_index = index_of_node_ptr(page);
+  if (memory_index >= managed_memory_size())
+    report_memory_error("invalid free of address not managed by arena",
+                        address, this);
+  if (memory_index & (min_page_size() - 1))
+    report_memory_error("invalid free of address not aligned to page",
+                        address, this);
+  // Headers of free pages are poisoned for address sanitizers.
+  if (memory_region_is_poisoned(page, page_header_size))
+    report_memory_error("double free or invalid free", address, this);
+  if ((reinterpret_cast<size_t>(page->next) & page_magic_mask) ==
+      freed_page_magic)
+    report_memory_error("double free", address, this);
+  {
+    std::scoped_lock lock{mutex};
+    for (size_t i = 0; i < page_levels(); ++i) {
+      if (memory_index & ((size_t{1} << (i + min_page_size_exp)) - 1)) break;
+      if (free_pages[i].test(page_number(page, i)))
+        report_memory_error("double free", address, this);
+    }
+  }
+  report_memory_error("invalid free or corrupted page header", address, this);
+}
 
 inline void* arena::malloc(size_t size) noexcept {
   // We do not support allocating memory with size zero.
   if (!size) return nullptr;
+  // Large blocks fall back to the buddy system if they cannot be mapped.
+  if (size > large_allocation_threshold())
+    if (const auto address = malloc_large(size)) return address;
+  auto page = malloc_page(size);
+  // Empty pages of object pools may provide enough memory.
+  if (!page && release_object_pools()) page = malloc_page(size);
+  if (!page) return nullptr;
+  const auto address = reinterpret_cast<void*>(page + 1);
+  if (const auto p = profiler.load(std::memory_order_acquire))
+    if (p->should_sample(size)) sample_page(page, address, size);
+  return address;
+}
+
+inline auto arena::malloc_page(size_t size) noexcept -> node* {
   // Compute the actual size of the page by calculating the next power of two
   // bucket.
-  const auto page_size_exp = next_size_exp(size + page_header_size);
+  const auto page_size_exp =
+      next_size_exp(size + page_header_size + page_footer_size);
   // Check for too large page size.
   if (page_size_exp > max_page_size_exp) return nullptr;
   // Search for a possible split index starting from the given page size.
   // We have to lock the mutex to not let another thread
   // alter the list of free pages.
-  std::scoped_lock lock{mutex};
-  const int index = page_size_exp - min_page_size_exp;
-  for (int split = index; split < free_pages.size(); ++split) {
-    if (free_pages[split]) {
-      // When found, pop the split buddy.
-      const auto result = free_pages[split];
-      free_pages[split] = result->next;
-      // Iterate over all resulting free splitted buddies.
-      for (int i = split - 1; i >= index; --i) {
-        // Push those new free splitted buddies by first computing their
-        // address. We need to take care of pointer arithmetic because we are
-        // counting bytes.
-        free_pages[i] =
-            result + ((size_t{1} << (min_page_size_exp + i)) / sizeof(node*));
-        // We know that the list was previously empty.
-        free_pages[i]->next = nullptr;
-      }
-      // Write index into the header of the page.
-      result->next = reinterpret_cast<node*>(index);
-      // Return the allocated splitted buddy without the header to the user.
-      // This address again has to be 64-byte aligned because we made sure to
-      // allocate the underlying memory with a 64-byte alignment and moved the
-      // base pointer 8 byte to the left to give space for the page header.
-      return reinterpret_cast<void*>(result + 1);
-    }
+  const auto index = page_size_exp - min_page_size_exp;
+  std::unique_lock lock{mutex};
+  auto result = pop_page(index);
+  // Pending pages may contain enough memory after being merged.
+  if (!result &&
+      (unmerged_pages || pending_pages.load(std::memory_order_relaxed))) {
+    lock.unlock();
+    merge_pending_pages(std::chrono::steady_clock::time_point::max());
+    lock.lock();
+    result = pop_page(index);
+  }
+  // The free page that is purged without holding the lock may be needed.
+  while (!result && purging_page) {
+    purge_interrupted.store(true, std::memory_order_relaxed);
+    purge_finished.wait(lock, [this] { return !purging_page; });
+    result = pop_page(index);
   }
   // If there was no possible split index, we do not have enough memory.
+  if (!result) return nullptr;
+  lock.unlock();
+
+  // Return the allocated splitted buddy without the header to the user.
+  // This address again has to be 64-byte aligned because we made sure to
+  // allocate the underlying memory with a 64-byte alignment and moved the
+  // base pointer 8 byte to the left to give space for the page header.
+  const auto address = reinterpret_cast<void*>(result + 1);
+  if constexpr (hardened) {
+    const auto canary = page_canary(result, index);
+    unpoison_memory_region(canary, page_footer_size);
+    *canary = canary_value(result);
+    poison_memory_region(canary, page_footer_size);
+  }
+  annotate_allocation(this, address, size);
+  return result;
+}
+
+inline void arena::sample_page(node* page, void* address,
+                               size_t size) noexcept {
+  const auto granted = (size_t{1} << (page_index(page) + min_page_size_exp)) -
+                       page_header_size - page_footer_size;
+  if (profiler.load(std::memory_order_relaxed)->record(address, size, granted))
+    page->next = reinterpret_cast<node*>(reinterpret_cast<size_t>(page->next) |
+                                         sampled_page_flag);
+}
+
+inline void arena::sample_slot(void* address, size_t size,
+                               size_t slot_size) noexcept {
+  if (!profiler.load(std::memory_order_relaxed)->record(address, size,
+                                                        slot_size))
+    return;
+  __atomic_fetch_or(object_pool_header(address), sampled_page_flag,
+                    __ATOMIC_RELAXED);
+}
+
+inline void arena::forget_slot_sample(void* address) noexcept {
+  if (__atomic_load_n(object_pool_header(address), __ATOMIC_RELAXED) &
+      sampled_page_flag)
+    profiler.load(std::memory_order_acquire)->remove(address);
+}
+
+inline void* arena::malloc_large(size_t size) noexcept {
+#if defined(__linux__)
+  static const auto system_page_size =
+      static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  if (size > std::numeric_limits<size_t>::max() - system_page_size)
+    return nullptr;
+  const auto granted = (size + system_page_size - 1) & ~(system_page_size - 1);
+  const auto address = mmap(nullptr, granted, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (address == MAP_FAILED) return nullptr;
+  try {
+    std::scoped_lock lock{large_blocks_mutex};
+    large_blocks.emplace(address, granted);
+  } catch (...) {
+    munmap(address, granted);
+    return nullptr;
+  }
+  if (const auto p = profiler.load(std::memory_order_acquire))
+    if (p->should_sample(size)) p->record(address, size, granted);
+  return address;
+#else
+  return nullptr;
+#endif
+}
+
+inline bool arena::free_large(void* address) noexcept {
+#if defined(__linux__)
+  size_t size;
+  {
+    std::scoped_lock lock{large_blocks_mutex};
+    const auto it = large_blocks.find(address);
+    if (it == end(large_blocks)) return false;
+    size = it->second;
+    large_blocks.erase(it);
+  }
+  if (const auto p = profiler.load(std::memory_order_acquire))
+    p->remove(address);
+  munmap(address, size);
+  return true;
+#else
+  return false;
+#endif
+}
+
+inline size_t arena::large_block_size(const void* address) const noexcept {
+  std::scoped_lock lock{large_blocks_mutex};
+  const auto it = large_blocks.find(address);
+  return (it == end(large_blocks)) ? 0 : it->second;
+}
+
+inline void arena::start_profiling(size_t sample_interval) {
+  auto p = profiler.load(std::memory_order_acquire);
+  if (!p) {
+    // Allocating the profiler may use this arena. So no lock can be held.
+    auto candidate = new heap_profiler{sample_interval};
+    if (profiler.compare_exchange_strong(p, candidate,
+                                         std::memory_order_acq_rel))
+      return;
+    delete candidate;
+  }
+  p->set_sample_interval(sample_interval);
+}
+
+inline void arena::stop_profiling() noexcept {
+  if (const auto p = profiler.load(std::memory_order_acquire))
+    p->set_sample_interval(0);
+}
+
+inline void arena::write_heap_profile(std::ostream& os,
+                                      profile_format format) const {
+  if (const auto p = profiler.load(std::memory_order_acquire))
+    p->write(os, format);
+  else
+    heap_profiler{}.write(os, format);
+}
+
+inline auto arena::pop_page(size_t index) noexcept -> node* {
+  for (auto split = index; split < page_levels(); ++split) {
+    if (free_pages[split].empty()) continue;
+    // When found, pop the split buddy. Taking the first free page keeps
+    // allocations close to the beginning of the memory.
+    auto number = free_pages[split].find_first();
+    free_pages[split].reset(number);
+    // Keep the left half and mark the right half as free for all splits.
+    for (auto i = split; i > index; --i) {
+      number <<= 1;
+      free_pages[i - 1].set(number + 1);
+    }
+    // Write index into the header of the page. This is the only access to the
+    // managed memory and it happens in the memory that the user gets anyway.
+    const auto result = page_of_number(number, index);
+    unpoison_memory_region(result, page_header_size);
+    set_page_index(result, index);
+    mark_dirty_chunks(number << (index + min_page_size_exp),
+                      size_t{1} << (index + min_page_size_exp));
+    return result;
+  }
   return nullptr;
 }
 
+template <size_t size, size_t alignment>
+inline void* arena::malloc_object() noexcept {
+  constexpr auto slot_size = object_slot_size(size, alignment);
+  // Large or overaligned objects use the usual pages. In hardened mode, all
+  // objects use pages to be able to detect memory errors.
+  if constexpr (hardened || (slot_size > max_object_size) ||
+                (alignment > page_alignment)) {
+    return malloc(size);
+  } else {
+    // Pages of tiny arenas may be too small for a single slot.
+    if (!object_pool_slots(slot_size)) return malloc(size);
+    auto& pool = object_pools[slot_size / object_granularity - 1];
+    node* result;
+    {
+      std::unique_lock lock{pool.mutex};
+      if (!pool.head && !refill_object_pool(pool, slot_size)) {
+        // Other pools may own empty pages. Releasing them needs their locks.
+        lock.unlock();
+        if (!release_object_pools()) return nullptr;
+        lock.lock();
+        if (!pool.head && !refill_object_pool(pool, slot_size)) return nullptr;
+      }
+      result = pool.head;
+      pool.head = result->next;
+      if (__atomic_fetch_add(object_pool_header(result), live_slot_unit,
+                             __ATOMIC_RELAXED) < live_slot_unit)
+        --pool.empty_pages;
+    }
+    // The whole slot counts for the sampling.
+    if (const auto p = profiler.load(std::memory_order_acquire))
+      if (p->should_sample(slot_size)) sample_slot(result, size, slot_size);
+    return result;
+  }
+}
+
+template <size_t size, size_t alignment>
+inline void arena::free_object(void* address) noexcept {
+  constexpr auto slot_size = object_slot_size(size, alignment);
+  if constexpr (hardened || (slot_size > max_object_size) ||
+                (alignment > page_alignment)) {
+    free(address);
+  } else {
+    if (!object_pool_slots(slot_size)) return free(address);
+    if (!address) return;
+    if (profiler.load(std::memory_order_acquire)) forget_slot_sample(address);
+    auto& pool = object_pools[slot_size / object_granularity - 1];
+    const auto slot = reinterpret_cast<node*>(address);
+    std::scoped_lock lock{pool.mutex};
+    slot->next = pool.head;
+    pool.head = slot;
+    if (__atomic_sub_fetch(object_pool_header(slot), live_slot_unit,
+                           __ATOMIC_RELAXED) < live_slot_unit)
+      ++pool.empty_pages;
+  }
+}
+
+inline bool arena::refill_object_pool(object_pool& pool,
+                                      size_t slot_size) noexcept {
+  // Split a whole page into slots. The page itself is never sampled.
+  // Otherwise, it would be charged to the caller as long as it is not empty.
+  const auto count = object_pool_slots(slot_size);
+  const auto page =
+      malloc_page(object_pool_page() - page_header_size - page_footer_size);
+  if (!page) return false;
+  ++pool.empty_pages;
+  const auto slots = reinterpret_cast<std::byte*>(page + 1);
+  // Push slots in reverse order to hand them out with increasing addresses.
+  for (auto i = count; i > 0; --i) {
+    const auto slot = reinterpret_cast<node*>(slots + (i - 1) * slot_size);
+    slot->next = pool.head;
+    pool.head = slot;
+  }
+  return true;
+}
+
+inline bool arena::release_object_pools() noexcept {
+  // The first slots of released pages are linked to merge all pages with a
+  // single lock of the arena.
+  node* released{};
+  for (size_t i = 0; i < object_pools.size(); ++i) {
+    auto& pool = object_pools[i];
+    std::scoped_lock lock{pool.mutex};
+    if (!pool.empty_pages) continue;
+    // All slots of empty pages are free. Stop when all of them were removed.
+    auto slots =
+        pool.empty_pages * object_pool_slots((i + 1) * object_granularity);
+    for (auto link = &pool.head; slots;) {
+      const auto slot = *link;
+      const auto page = object_pool_page_of(slot);
+      if (__atomic_load_n(object_pool_header(slot), __ATOMIC_RELAXED) >=
+          live_slot_unit) {
+        link = &slot->next;
+        continue;
+      }
+      *link = slot->next;
+      --slots;
+      if (slot == page + 1) {
+        slot->next = released;
+        released = slot;
+      }
+    }
+    pool.empty_pages = 0;
+  }
+  if (!released) return false;
+  std::scoped_lock lock{mutex};
+  while (released) {
+    const auto page = released - 1;
+    released = released->next;
+    const auto index = page_index(page);
+    annotate_deallocation(this, page + 1,
+                          (size_t{1} << (index + min_page_size_exp)) -
+                              page_header_size);
+    merge_page(page, index);
+  }
+  return true;
+}
+
 inline bool arena::is_valid(void* ptr) const noexcept {
   if (!ptr) return false;
-  // Cast difference to unsigned integer to make bounds testing easier.
-  const auto page = reinterpret_cast<node*>(ptr) - 1;
-  const auto memory_index = static_cast<size_t>(page - base);
-  // The pointer should lie in the space of our allocated memory.
-  if (memory_index >= managed_memory_size()) return false;
-  // Now we can access memory without segmentation fault and are able to ask for
-  // the pages size. Again, we use an unsigned integer for easier bounds
-  // testing.
-  const auto index = reinterpret_cast<size_t>(page->next);
-  // free_pages.size() does not change. No mutex lock is needed.
-  if (index >= free_pages.size()) return false;
-  // Address must provide the alignment of its page size.
-  if (memory_index & ((size_t{1} << (index + min_page_size_exp)) - size_t{1}))
-    return false;
+  if (!contains(ptr)) return large_block_size(ptr) != 0;
+  size_t index;
+  const auto page = validated_page(ptr, index);
+  if (!page) return false;
   // Check if the existing page is already a free page.
   // For this, the mutex has to be locked
   // so the list cannot be changed by another thread.
   std::scoped_lock lock{mutex};
-  for (auto it = free_pages[index]; it; it = it->next)
-    if (it == page) return false;
-  return true;
+  return !free_pages[index].test(page_number(page, index));
 }
 
 inline void arena::free(void* address) noexcept {
@@ -192,78 +839,324 @@ inline void arena::free(void* address) noexcept {
 
   // Do nothing with an empty address.
   if (!address) return;
+  // In hardened mode, invalid frees are reported instead of being ignored.
+  const auto invalid_free = [&] {
+    if constexpr (hardened) report_invalid_free(address);
+  };
+  size_t index;
+  const auto page = validated_page(address, index);
+  if (!page) {
+    // Large blocks lie outside of the managed memory.
+    if (!contains(address) && free_large(address)) return;
+    return invalid_free();
+  }
+  forget_sample(page, address);
+  // A deferred free does not need to lock the mutex. Pending pages get a
+  // header that is invalid for free. So double frees are still detected.
+  if (is_deferring_free()) {
+    push_pending_page(pending_pages, page, index);
+    return;
+  }
+  // Check if the existing page is already a free page.
+  // For this, the mutex has to be locked
+  // so the list cannot be changed by another thread.
+  std::unique_lock lock{mutex};
+  if (free_pages[index].test(page_number(page, index))) {
+    lock.unlock();
+    return invalid_free();
+  }
+
+  // At this point, we know the given address was allocated by the buddy system.
+  // And we already locked the data structure to not be used by other threads.
+
+  const auto size = (size_t{1} << (index + min_page_size_exp)) -
+                    page_header_size - page_footer_size;
+  if constexpr (hardened) {
+    // A broken canary means that something has written past the end of the
+    // page which would otherwise silently corrupt the neighboring page header.
+    const auto canary = page_canary(page, index);
+    unpoison_memory_region(canary, page_footer_size);
+    if (*canary != canary_value(page)) {
+      lock.unlock();
+      report_memory_error("buffer overflow detected at end of page", address,
+                          this);
+    }
+    // Poison the freed page and mark its header to detect double frees.
+    unpoison_memory_region(address, size + page_footer_size);
+    std::memset(address, freed_memory_pattern, size + page_footer_size);
+    page->next = reinterpret_cast<node*>(freed_page_magic | index);
+  }
+  annotate_deallocation(this, address, size + page_footer_size);
+  merge_page(page, index);
+}
+
+inline auto arena::validated_page(void* address, size_t& index) const noexcept
+    -> node* {
   // Cast difference to unsigned integer to make bounds testing easier.
-  auto page = reinterpret_cast<node*>(address) - 1;
+  const auto page = reinterpret_cast<node*>(address) - 1;
   const auto memory_index = index_of_node_ptr(page);
   // The pointer should lie in the space of our allocated memory.
-  if (memory_index >= managed_memory_size()) return;
+  if (memory_index >= managed_memory_size()) return nullptr;
+  // Headers of free pages are poisoned for address sanitizers.
+  if (memory_region_is_poisoned(page, page_header_size)) return nullptr;
   // Now we can access memory without segmentation fault and are able to ask for
   // the pages size. Again, we use an unsigned integer for easier bounds
   // testing.
-  auto index = reinterpret_cast<size_t>(page->next);
-  if (index >= free_pages.size()) return;
+  index = page_index(page);
+  if (index >= page_levels()) return nullptr;
   // Address must provide the alignment of its page size.
   if (memory_index & ((size_t{1} << (index + min_page_size_exp)) - size_t{1}))
-    return;
-  // Check if the existing page is already a free page.
-  // For this, the mutex has to be locked
-  // so the list cannot be changed by another thread.
-  std::scoped_lock lock{mutex};
-  for (auto it = free_pages[index]; it; it = it->next)
-    if (it == page) return;
+    return nullptr;
+  return page;
+}
 
-  // At this point, we know the given address was allocated by the buddy system.
-  // And we already locked the data structure to not be used by other threads.
+inline void arena::merge_page(node* page, size_t index) noexcept {
+  // From now on, the header belongs to a free page.
+  poison_memory_region(page, page_header_size);
+  auto number = page_number(page, index);
+  // The buddy of a page only differs in the lowest bit of its number. As long
+  // as the buddy is free, remove it and continue with the merged page.
+  for (; index + 1 < page_levels(); ++index, number >>= 1) {
+    if (!free_pages[index].test(number ^ 1)) break;
+    free_pages[index].reset(number ^ 1);
+  }
+  free_pages[index].set(number);
+}
 
-  for (;; ++index) {
-    // Construct mask and test numbers to test if two pages are buddies.
-    const auto is_buddy_mask = ~(size_t{1} << (index + min_page_size_exp));
-    const auto buddy_test = index_of_node_ptr(page) & is_buddy_mask;
-
-    // Go trough the list of pages with this size and look for the possible
-    // merge buddy.
-    node* buddy = nullptr;
-    auto prev = reinterpret_cast<node*>(&free_pages[index]);
-    for (auto it = free_pages[index]; it; prev = it, it = it->next) {
-      // Test if the current page in the list is the buddy.
-      if ((((it - base) * sizeof(node)) & is_buddy_mask) == buddy_test) {
-        buddy = it;
-        break;
-      }
+inline void arena::mark_dirty_chunks(size_t offset, size_t size) noexcept {
+  if (!purges_memory()) return;
+  const auto first = offset >> purge_chunk_size_exp;
+  const auto last = (offset + size - 1) >> purge_chunk_size_exp;
+  for (auto chunk = first; chunk <= last; ++chunk) dirty_chunks.set(chunk);
+  // An interrupted purge of one of these chunks has to start again.
+  const auto purged = purge_offset >> purge_chunk_size_exp;
+  if ((first <= purged) && (purged <= last))
+    purge_offset = purged << purge_chunk_size_exp;
+}
+
+inline void arena::push_pending_page(std::atomic<node*>& list, node* page,
+                                     size_t index) noexcept {
+  const auto address = reinterpret_cast<void*>(page + 1);
+  const auto size = (size_t{1} << (index + min_page_size_exp)) -
+                    page_header_size - page_footer_size;
+  if constexpr (hardened) {
+    const auto canary = page_canary(page, index);
+    unpoison_memory_region(canary, page_footer_size);
+    if (*canary != canary_value(page))
+      report_memory_error("buffer overflow detected at end of page", address,
+                          this);
+    unpoison_memory_region(address, size + page_footer_size);
+    std::memset(address, freed_memory_pattern, size + page_footer_size);
+  }
+  annotate_deallocation(this, address, size + page_footer_size);
+  page->next = reinterpret_cast<node*>(freed_page_magic | index);
+  // The link to the next pending page is stored behind the page header.
+  const auto link = page + 1;
+  unpoison_memory_region(link, sizeof(node));
+  link->next = list.load(std::memory_order_relaxed);
+  while (!list.compare_exchange_weak(link->next, page,
+                                     std::memory_order_release,
+                                     std::memory_order_relaxed))
+    ;
+}
+
+inline auto arena::merge_page_list(
+    node* pages, std::chrono::steady_clock::time_point deadline) noexcept
+    -> node* {
+  for (size_t count = 1; pages; ++count) {
+    const auto page = pages;
+    pages = (page + 1)->next;
+    poison_memory_region(page + 1, sizeof(node));
+    merge_page(page, reinterpret_cast<size_t>(page->next) & ~page_magic_mask);
+    if (!(count % maintain_check_interval) &&
+        (std::chrono::steady_clock::now() >= deadline))
+      break;
+  }
+  return pages;
+}
+
+inline bool arena::merge_pending_pages(
+    std::chrono::steady_clock::time_point deadline) noexcept {
+  std::scoped_lock lock{mutex};
+  // First, continue with the pages that were left by the last call. Then,
+  // take the whole pending list at once. Hence, other threads can still push
+  // while we are merging and no ABA problem can occur.
+  for (size_t batch = 0; batch < 2; ++batch) {
+    if (!unmerged_pages)
+      unmerged_pages =
+          pending_pages.exchange(nullptr, std::memory_order_acquire);
+    unmerged_pages = merge_page_list(unmerged_pages, deadline);
+    if (unmerged_pages) return true;
+  }
+  return pending_pages.load(std::memory_order_relaxed);
+}
+
+inline bool arena::purge_free_pages(
+    std::chrono::steady_clock::time_point deadline) noexcept {
+#if defined(__linux__)
+  if (!purges_memory()) return false;
+  static const auto system_page_size =
+      static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  const auto address = [&](size_t offset) {
+    return reinterpret_cast<uintptr_t>(base) + offset;
+  };
+  const auto align_up = [&](uintptr_t x) {
+    return (x + system_page_size - 1) & ~(system_page_size - 1);
+  };
+  const auto chunk_index = purge_chunk_size_exp - min_page_size_exp;
+  std::unique_lock lock{mutex};
+  // Another thread is already purging.
+  if (purging_page) return false;
+  for (size_t count = 1;; ++count) {
+    const auto chunk =
+        dirty_chunks.find_next(purge_offset >> purge_chunk_size_exp);
+    if (chunk == dirty_chunks.size()) {
+      purge_offset = 0;
+      return false;
     }
-    // If there is no buddy for merging, push the given page to the list.
-    // At some point, this will always be true.
-    if (buddy == nullptr) {
-      page->next = free_pages[index];
-      free_pages[index] = page;
-      return;
+    purge_offset = std::max(purge_offset, chunk << purge_chunk_size_exp);
+    // Only chunks that lie inside of a free page can be purged.
+    auto index = chunk_index;
+    while ((index < page_levels()) &&
+           !free_pages[index].test(chunk >> (index - chunk_index)))
+      ++index;
+    if (index == page_levels()) {
+      purge_offset = (chunk + 1) << purge_chunk_size_exp;
+      if (!(count % maintain_check_interval) &&
+          (std::chrono::steady_clock::now() >= deadline))
+        return true;
+      continue;
+    }
+    // Take the free page out. So nobody can allocate it while its memory is
+    // purged without holding the lock.
+    const auto number = chunk >> (index - chunk_index);
+    free_pages[index].reset(number);
+    purging_page = page_of_number(number, index);
+    purging_index = index;
+    purge_interrupted.store(false, std::memory_order_relaxed);
+    const auto page_first = number << (index + min_page_size_exp);
+    const auto page_last =
+        page_first + (size_t{1} << (index + min_page_size_exp));
+    // System pages that are shared with neighboring pages are not purged.
+    const auto first_address = align_up(address(page_first));
+    const auto last_address = address(page_last) & ~(system_page_size - 1);
+    bool timeout = false;
+    for (auto c = chunk; !timeout && ((c << purge_chunk_size_exp) < page_last);
+         c = dirty_chunks.find_next(c + 1)) {
+      const auto chunk_last = (c + 1) << purge_chunk_size_exp;
+      auto offset = std::max(purge_offset, c << purge_chunk_size_exp);
+      lock.unlock();
+      while (!timeout && (offset < chunk_last)) {
+        const auto slice_last = std::min(offset + purge_slice_size, chunk_last);
+        const auto first = std::max(align_up(address(offset)), first_address);
+        const auto last = std::min(align_up(address(slice_last)), last_address);
+        if (first < last)
+          madvise(reinterpret_cast<void*>(first), last - first, MADV_DONTNEED);
+        offset = slice_last;
+        // An interrupted purge continues later like one that ran out of time.
+        timeout = (std::chrono::steady_clock::now() >= deadline) ||
+                  purge_interrupted.load(std::memory_order_relaxed);
+      }
+      lock.lock();
+      purge_offset = offset;
+      if (offset == chunk_last) dirty_chunks.reset(c);
     }
-    // Otherwise, we have found the buddy page and therefore have to pop and
-    // merge it with our current page.
-    prev->next = buddy->next;
-    page = base + buddy_test / sizeof(node);
-    // We have to repeat these instructions to check if we have to do a merge
-    // for the next higher page size.
+    purging_page = nullptr;
+    merge_page(page_of_number(number, index), index);
+    purge_finished.notify_all();
+    if (timeout) return true;
   }
+#else
+  return false;
+#endif
+}
+
+inline bool arena::maintain(std::chrono::nanoseconds budget) noexcept {
+  const auto now = std::chrono::steady_clock::now();
+  // Prevent overflows for large budgets.
+  const auto deadline =
+      (budget >= std::chrono::steady_clock::time_point::max() - now)
+          ? std::chrono::steady_clock::time_point::max()
+          : now + std::chrono::duration_cast<
+                      std::chrono::steady_clock::duration>(budget);
+  release_object_pools();
+  if (merge_pending_pages(deadline)) return true;
+  return purge_free_pages(deadline);
 }
 
 inline size_t arena::available_memory_size() const noexcept {
   std::scoped_lock lock{mutex};
   size_t result{};
-  for (size_t i = 0; i < free_pages.size(); ++i) {
-    for (auto it = free_pages[i]; it; it = it->next)
-      result += (size_t{1} << (i + min_page_size_exp));
-  }
+  for (size_t i = 0; i < page_levels(); ++i)
+    result += free_pages[i].count() << (i + min_page_size_exp);
   return result;
 }
 
 inline size_t arena::max_available_page_size() const noexcept {
   std::scoped_lock lock{mutex};
-  for (auto i = free_pages.size(); i > 0; --i)
-    if (free_pages[i - 1]) return size_t{1} << (i - 1 + min_page_size_exp);
+  for (auto i = page_levels(); i > 0; --i)
+    if (!free_pages[i - 1].empty())
+      return size_t{1} << (i - 1 + min_page_size_exp);
   return 0;
 }
 
+inline bool arena::check_invariants() const noexcept {
+  std::scoped_lock lock{mutex};
+  size_t free_bytes{};
+  size_t allocated_bytes{};
+  size_t free_page_count{};
+  size_t offset = 0;
+  while (offset < managed_memory_size()) {
+    const auto page = base + offset / sizeof(node);
+    // Find all free pages starting at this offset.
+    size_t free_index = page_levels();
+    for (size_t i = 0; i < page_levels(); ++i) {
+      if (offset & ((size_t{1} << (i + min_page_size_exp)) - 1)) break;
+      if (!free_pages[i].test(page_number(page, i))) continue;
+      // Two free pages of different sizes would overlap.
+      if (free_index != page_levels()) return false;
+      free_index = i;
+    }
+    if (free_index != page_levels()) {
+      const auto number = page_number(page, free_index);
+      // Free buddies have to be merged.
+      if ((free_index + 1 < page_levels()) &&
+          free_pages[free_index].test(number ^ 1))
+        return false;
+      const auto size = size_t{1} << (free_index + min_page_size_exp);
+      free_bytes += size;
+      offset += size;
+      ++free_page_count;
+      continue;
+    }
+    // The page that is currently purged is neither free nor allocated.
+    if (purging_page && (page == purging_page)) {
+      const auto size = size_t{1} << (purging_index + min_page_size_exp);
+      free_bytes += size;
+      offset += size;
+      continue;
+    }
+    // Otherwise, the page is allocated or pending and owns a valid header.
+    if (memory_region_is_poisoned(page, page_header_size)) return false;
+    const auto header = reinterpret_cast<size_t>(page->next);
+    const auto index = ((header & page_magic_mask) == freed_page_magic)
+                           ? (header & ~page_magic_mask)
+                           : page_index(page);
+    if (index >= page_levels()) return false;
+    const auto size = size_t{1} << (index + min_page_size_exp);
+    if (offset & (size - 1)) return false;
+    allocated_bytes += size;
+    offset += size;
+  }
+  if (offset != managed_memory_size()) return false;
+  // Free pages that have not been visited lie inside of other pages.
+  size_t marked_page_count{};
+  for (size_t i = 0; i < page_levels(); ++i)
+    marked_page_count += free_pages[i].count();
+  if (marked_page_count != free_page_count) return false;
+  return free_bytes + allocated_bytes == managed_memory_size();
+}
+
 inline std::ostream& operator<<(std::ostream& os, const arena& bs) {
   using namespace std;
 
@@ -304,24 +1197,28 @@ inline std::ostream& operator<<(std::ostream& os, const arena& bs) {
      << '\n'
      << "minimal page size exp  = " << setw(20) << bs.min_page_size_exp << '\n'
      << '\n'
-     << "free pages lists size  = " << setw(20) << bs.free_pages.size() << '\n'
-     << "free pages lists memory= " << setw(20)
-     << bs.free_pages.size() * sizeof(bs.free_pages[0]) << " B" << '\n'
+     << "free pages levels      = " << setw(20) << bs.page_levels() << '\n'
+     << "free pages bitmaps size= " << setw(20)
+     << bs.metadata_size(bs.max_page_size_exp, bs.min_page_size_exp) << " B"
+     << '\n'
      << "available memory size  = " << setw(20) << bs.available_memory_size()
      << " B" << '\n'
      << "max available page size= " << setw(20) << bs.max_available_page_size()
      << " B" << '\n'
      << '\n'
-     << "free pages lists content:" << '\n';
+     << "free pages content:" << '\n';
 
   std::scoped_lock lock{bs.mutex};
 
   for (int i = bs.max_page_size_exp; i >= bs.min_page_size_exp; --i) {
     os << setw(4) << "2^" << setw(2) << i << " B = " << setw(10) << (1ull << i)
        << " B :";
-    for (auto it = bs.free_pages[i - bs.min_page_size_exp]; it; it = it->next)
-      os << setw(5) << "-->" << setw(12)
-         << (it - bs.base) * sizeof(bs.free_pages[0]) << " (" << it << ")";
+    const auto index = i - bs.min_page_size_exp;
+    bs.free_pages[index].for_each([&](size_t number) {
+      const auto it = bs.page_of_number(number, index);
+      os << setw(5) << "-->" << setw(12) << bs.index_of_node_ptr(it) << " ("
+         << it << ")";
+    });
     os << '\n';
   }
   os << '\n';
@@ -336,22 +1233,22 @@ inline std::ostream& operator<<(std::ostream& os, const arena& bs) {
                                   bs.min_page_size_exp);
 
   for (size_t i = start_exp; i <= bs.max_page_size_exp; ++i) {
-    for (auto it = bs.free_pages[i - bs.min_page_size_exp]; it; it = it->next) {
+    bs.free_pages[i - bs.min_page_size_exp].for_each([&](size_t number) {
       const auto size = size_t{1} << i;
-      const auto index = bs.index_of_node_ptr(it);
+      const auto index = number << i;
       const auto length = size >> (bs.max_page_size_exp - scheme_size_exp);
       auto scheme_index = index >> (bs.max_page_size_exp - scheme_size_exp);
       scheme[scheme_index] = '[';
       for (size_t j = 1; j < length - 1; ++j) scheme[scheme_index + j] = '-';
       scheme[scheme_index + length - 1] = ']';
-    }
+    });
   }
   for (size_t i = bs.min_page_size_exp; i < start_exp; ++i) {
-    for (auto it = bs.free_pages[i - bs.min_page_size_exp]; it; it = it->next) {
-      const auto index = bs.index_of_node_ptr(it);
+    bs.free_pages[i - bs.min_page_size_exp].for_each([&](size_t number) {
+      const auto index = number << i;
       auto scheme_index = index >> (bs.max_page_size_exp - scheme_size_exp);
       scheme[scheme_index] = '|';
-    }
+    });
   }
   scheme[scheme_size - 1] = '\0';
   os << "Memory Layout Scheme of Free Pages: "
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace lyrahgames::buddy_system {
+
+// The hierarchical bitmap stores a set of indices inside of external memory.
+// Every layer summarizes the layer below by using one bit per word, which is
+// set if and only if the respective word is not zero. The top layer consists
+// of a single word. Hence, finding a set bit only reads one word per layer and
+// the memory of the bitmap is dense and never interleaved with other data.
+class hierarchical_bitmap {
+ public:
+  using word = uint64_t;
+  static constexpr size_t word_bits = 64;
+  // Enough layers for 2^48 bits.
+  static constexpr size_t max_layers = 8;
+
+  // Number of words that are needed to store the given amount of bits.
+  static constexpr size_t words_for(size_t bits) noexcept {
+    size_t result = 0;
+    do {
+      bits = (bits + word_bits - 1) / word_bits;
+      result += bits;
+    } while (bits > 1);
+    return result;
+  }
+
+  hierarchical_bitmap() = default;
+  // The given memory has to provide words_for(bits) zero-initialized words.
+  hierarchical_bitmap(word* memory, size_t bits) noexcept : bits{bits} {
+    do {
+      bits = (bits + word_bits - 1) / word_bits;
+      layers[layer_count++] = memory;
+      memory += bits;
+    } while (bits > 1);
+  }
+
+  size_t size() const noexcept { return bits; }
+  bool empty() const noexcept { return !layers[layer_count - 1][0]; }
+
+  bool test(size_t index) const noexcept {
+    return (layers[0][index / word_bits] >> (index % word_bits)) & word{1};
+  }
+
+  void set(size_t index) noexcept {
+    for (size_t i = 0; i < layer_count; ++i) {
+      auto& w = layers[i][index / word_bits];
+      const auto old = w;
+      w |= word{1} << (index % word_bits);
+      // The upper layers already know about this word.
+      if (old) return;
+      index /= word_bits;
+    }
+  }
+
+  void reset(size_t index) noexcept {
+    for (size_t i = 0; i < layer_count; ++i) {
+      auto& w = layers[i][index / word_bits];
+      w &= ~(word{1} << (index % word_bits));
+      // The upper layers only change if the word becomes zero.
+      if (w) return;
+      index /= word_bits;
+    }
+  }
+
+  // Return the smallest set index. The bitmap must not be empty.
+  size_t find_first() const noexcept {
+    size_t index = 0;
+    for (auto i = layer_count; i > 0; --i)
+      index = index * word_bits + __builtin_ctzll(layers[i - 1][index]);
+    return index;
+  }
+
+  // Return the smallest set index which is not less than the given one or
+  // size() if there is none.
+  size_t find_next(size_t index) const noexcept {
+    if (index >= bits) return bits;
+    // Go up until a word contains a set bit at or behind the position.
+    size_t i = 0;
+    for (auto n = bits;; ++i) {
+      const auto w = layers[i][index / word_bits] &
+                     (~word{0} << (index % word_bits));
+      if (w) {
+        index = index / word_bits * word_bits + __builtin_ctzll(w);
+        break;
+      }
+      index = index / word_bits + 1;
+      n = (n + word_bits - 1) / word_bits;
+      if ((i + 1 == layer_count) || (index >= n)) return bits;
+    }
+    // Go down to the first set bit below the found one.
+    for (; i > 0; --i)
+      index = index * word_bits + __builtin_ctzll(layers[i - 1][index]);
+    return index;
+  }
+
+  size_t count() const noexcept {
+    size_t result = 0;
+    const auto words = (bits + word_bits - 1) / word_bits;
+    for (size_t i = 0; i < words; ++i)
+      result += __builtin_popcountll(layers[0][i]);
+    return result;
+  }
+
+  // Call the given function for every set index in increasing order.
+  template <typename F>
+  void for_each(F f) const {
+    const auto words = (bits + word_bits - 1) / word_bits;
+    for (size_t i = 0; i < words; ++i)
+      for (auto w = layers[0][i]; w; w &= w - 1)
+        f(i * word_bits + __builtin_ctzll(w));
+  }
+
+ private:
+  word* layers[max_layers]{};
+  size_t layer_count{};
+  size_t bits{};
+};
+
+}  // namespace lyrahgames::buddy_system
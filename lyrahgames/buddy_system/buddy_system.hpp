@@ -2,5 +2,10 @@
 
 #include <lyrahgames/buddy_system/allocator.hpp>
 #include <lyrahgames/buddy_system/arena.hpp>
+#include <lyrahgames/buddy_system/bitmap.hpp>
+#include <lyrahgames/buddy_system/hardening.hpp>
+#include <lyrahgames/buddy_system/maintenance.hpp>
 #include <lyrahgames/buddy_system/new.hpp>
+#include <lyrahgames/buddy_system/profiler.hpp>
+#include <lyrahgames/buddy_system/remote_free_queue.hpp>
 #include <lyrahgames/buddy_system/utility.hpp>
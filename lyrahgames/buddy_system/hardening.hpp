@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+//
+#include <iostream>
+
+// The hardened mode is a compile-time option meant for hunting memory bugs.
+// Define LYRAHGAMES_BUDDY_SYSTEM_HARDENED before including the library (or add
+// it to the preprocessor options of the build) to enable it. The arena then
+// places canaries around its pages, poisons freed pages, reports invalid and
+// double frees, and annotates its memory for Valgrind. With the mode turned
+// off, every check in this file compiles to nothing.
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_HARDENED
+#if defined(__has_include)
+#if __has_include(<valgrind/memcheck.h>)
+#include <valgrind/memcheck.h>
+#define LYRAHGAMES_BUDDY_SYSTEM_VALGRIND 1
+#endif
+#endif
+#endif
+
+// AddressSanitizer annotations are independent of the hardened mode. They are
+// automatically enabled when the code is compiled with -fsanitize=address.
+#if defined(__SANITIZE_ADDRESS__)
+#define LYRAHGAMES_BUDDY_SYSTEM_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define LYRAHGAMES_BUDDY_SYSTEM_ASAN 1
+#endif
+#endif
+
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+
+namespace lyrahgames::buddy_system {
+
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_HARDENED
+inline constexpr bool hardened = true;
+#else
+inline constexpr bool hardened = false;
+#endif
+
+// Bytes written into freed pages so that use-after-free reads are noticeable.
+inline constexpr unsigned char freed_memory_pattern = 0xdd;
+
+// Mark the given memory region as not accessible for the user.
+inline void poison_memory_region([[maybe_unused]] const void* address,
+                                 [[maybe_unused]] size_t size) noexcept {
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_ASAN
+  ASAN_POISON_MEMORY_REGION(address, size);
+#endif
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_VALGRIND
+  VALGRIND_MAKE_MEM_NOACCESS(address, size);
+#endif
+}
+
+// Mark the given memory region as accessible again.
+inline void unpoison_memory_region([[maybe_unused]] const void* address,
+                                   [[maybe_unused]] size_t size) noexcept {
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_ASAN
+  ASAN_UNPOISON_MEMORY_REGION(address, size);
+#endif
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_VALGRIND
+  VALGRIND_MAKE_MEM_UNDEFINED(address, size);
+#endif
+}
+
+// Check if the given memory region contains poisoned bytes. Without an address
+// sanitizer, no memory is ever poisoned.
+inline bool memory_region_is_poisoned([[maybe_unused]] const void* address,
+                                      [[maybe_unused]] size_t size) noexcept {
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_ASAN
+  return __asan_region_is_poisoned(const_cast<void*>(address), size);
+#else
+  return false;
+#endif
+}
+
+// Valgrind sees the arena as a memory pool and its pages as allocations of
+// that pool. This gives leak checks and proper error messages for arena pages.
+inline void annotate_pool_creation([[maybe_unused]] const void* pool) noexcept {
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_VALGRIND
+  VALGRIND_CREATE_MEMPOOL(pool, 0, 0);
+#endif
+}
+
+inline void annotate_pool_destruction(
+    [[maybe_unused]] const void* pool) noexcept {
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_VALGRIND
+  VALGRIND_DESTROY_MEMPOOL(pool);
+#endif
+}
+
+inline void annotate_allocation([[maybe_unused]] const void* pool,
+                                [[maybe_unused]] const void* address,
+                                [[maybe_unused]] size_t size) noexcept {
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_VALGRIND
+  VALGRIND_MEMPOOL_ALLOC(pool, address, size);
+#endif
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_ASAN
+  ASAN_UNPOISON_MEMORY_REGION(address, size);
+#endif
+}
+
+inline void annotate_deallocation([[maybe_unused]] const void* pool,
+                                  [[maybe_unused]] const void* address,
+                                  [[maybe_unused]] size_t size) noexcept {
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_VALGRIND
+  VALGRIND_MEMPOOL_FREE(pool, address);
+#endif
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_ASAN
+  ASAN_POISON_MEMORY_REGION(address, size);
+#endif
+}
+
+// In hardened mode, every detected memory error ends the program with a short
+// message containing the offending address.
+[[noreturn]] inline void report_memory_error(const char* message,
+                                             const void* address,
+                                             const void* arena) noexcept {
+  std::cerr << "lyrahgames::buddy_system: " << message
+            << " (address = " << address << ", arena = " << arena << ")"
+            << std::endl;
+  std::abort();
+}
+
+}  // namespace lyrahgames::buddy_system
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+//
+#include <lyrahgames/buddy_system/arena.hpp>
+
+namespace lyrahgames::buddy_system {
+
+// The maintenance thread periodically calls arena::maintain in the background.
+// While it is running, the arena defers all deallocations. So freeing memory
+// only consists of pushing the page to a list. Instead of using this thread,
+// arena::maintain can also be called directly from an existing event loop.
+class maintenance_thread {
+ public:
+  explicit maintenance_thread(
+      arena& a,
+      std::chrono::nanoseconds budget = std::chrono::milliseconds{1},
+      std::chrono::nanoseconds interval = std::chrono::milliseconds{10})
+      : handle{a}, budget{budget}, interval{interval} {
+    handle.set_deferred_free(true);
+    thread = std::thread{[this] { run(); }};
+  }
+
+  ~maintenance_thread() {
+    {
+      std::scoped_lock lock{mutex};
+      done = true;
+    }
+    condition.notify_one();
+    thread.join();
+    // Merge everything that is still pending.
+    handle.set_deferred_free(false);
+    handle.maintain(std::chrono::nanoseconds::max());
+  }
+
+  maintenance_thread(const maintenance_thread&) = delete;
+  maintenance_thread& operator=(const maintenance_thread&) = delete;
+  maintenance_thread(maintenance_thread&&) = delete;
+  maintenance_thread& operator=(maintenance_thread&&) = delete;
+
+ private:
+  void run() {
+    std::unique_lock lock{mutex};
+    while (!done) {
+      lock.unlock();
+      // Directly continue if the budget was not enough to do all the work.
+      const auto busy = handle.maintain(budget);
+      lock.lock();
+      if (!busy) condition.wait_for(lock, interval, [this] { return done; });
+    }
+  }
+
+  arena& handle;
+  std::chrono::nanoseconds budget;
+  std::chrono::nanoseconds interval;
+  std::mutex mutex{};
+  std::condition_variable condition{};
+  bool done{};
+  std::thread thread{};
+};
+
+}  // namespace lyrahgames::buddy_system
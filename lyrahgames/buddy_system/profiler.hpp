@@ -0,0 +1,331 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+//
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+//
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+//
+#if defined(__has_include)
+#if __has_include(<unwind.h>)
+#include <unwind.h>
+#define LYRAHGAMES_BUDDY_SYSTEM_UNWIND 1
+#endif
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define LYRAHGAMES_BUDDY_SYSTEM_BACKTRACE 1
+#endif
+#endif
+
+namespace lyrahgames::buddy_system {
+
+enum class profile_format {
+  // Legacy heap profile of gperftools which can be read by pprof.
+  pprof,
+  // Human-readable list of allocation sites with symbolized stack traces.
+  text
+};
+
+// The heap profiler samples allocations of an arena. On average, one sample is
+// taken every sample_interval bytes of requested memory. For every sample, it
+// stores the stack trace together with the requested and granted size as long
+// as the allocation is alive. The distance between samples follows an
+// exponential distribution. So the sampling is not biased by periodic
+// allocation patterns and the real amount of live memory can be estimated.
+class heap_profiler {
+ public:
+  // Every sample unwinds the stack, which takes microseconds. So the overhead
+  // grows with the allocated bytes per second divided by the interval. The
+  // default keeps the overhead low even for programs that do hardly anything
+  // else than allocating memory, at the price of fewer samples per live byte.
+  static constexpr size_t default_sample_interval = size_t{1} << 25;
+  static constexpr size_t max_frames = 32;
+
+  // The estimates of a sample depend on the interval it was taken with.
+  struct sample {
+    size_t requested;
+    size_t granted;
+    size_t interval;
+    size_t depth;
+    void* frames[max_frames];
+  };
+
+  explicit heap_profiler(size_t interval = default_sample_interval) noexcept
+      : interval{interval}, last_interval{interval} {}
+
+  void set_sample_interval(size_t value) noexcept {
+    interval.store(value, std::memory_order_relaxed);
+    if (value) last_interval.store(value, std::memory_order_relaxed);
+    // Countdowns of the old interval are not used anymore.
+    key.store(next_key.fetch_add(1, std::memory_order_relaxed),
+              std::memory_order_relaxed);
+  }
+  size_t sample_interval() const noexcept {
+    return interval.load(std::memory_order_relaxed);
+  }
+  // A sample interval of zero disables the sampling. Samples of live
+  // allocations are kept until they are deallocated.
+  bool is_sampling() const noexcept { return sample_interval(); }
+
+  // Decide whether the allocation of the given size has to be sampled. This
+  // is called for every allocation and only counts down a thread-local value
+  // that belongs to this profiler.
+  bool should_sample(size_t size) noexcept {
+    const auto k = key.load(std::memory_order_relaxed);
+    auto& c = state.countdowns[k % countdown_count];
+    if ((c.key == k) && (c.bytes_until_sample > size)) {
+      c.bytes_until_sample -= size;
+      return false;
+    }
+    return should_sample_slow(c, k, size);
+  }
+
+  // Store a new sample for the given address. Returns false if the sample
+  // could not be stored.
+  __attribute__((noinline)) bool record(void* address, size_t requested,
+                                        size_t granted) noexcept {
+    // Recording may allocate memory which must not be sampled again.
+    if (state.busy) return false;
+    busy_guard guard{};
+    sample x{requested, granted, sample_interval(), 0, {}};
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_UNWIND
+    // In contrast to backtrace, the unwinder needs no lazy initialization
+    // that loads libraries and allocates memory. The first frame belongs to
+    // this function and is skipped.
+    struct trace {
+      sample& x;
+      bool skipped;
+    } t{x, false};
+    _Unwind_Backtrace(
+        [](_Unwind_Context* context, void* data) -> _Unwind_Reason_Code {
+          auto& t = *static_cast<trace*>(data);
+          if (!t.skipped) {
+            t.skipped = true;
+            return _URC_NO_REASON;
+          }
+          const auto ip = _Unwind_GetIP(context);
+          if (!ip || (t.x.depth == max_frames)) return _URC_END_OF_STACK;
+          t.x.frames[t.x.depth++] = reinterpret_cast<void*>(ip);
+          return _URC_NO_REASON;
+        },
+        &t);
+#endif
+    auto& s = shard_of(address);
+    try {
+      std::scoped_lock lock{s.mutex};
+      s.samples.insert_or_assign(address, x);
+    } catch (...) {
+      return false;
+    }
+    return true;
+  }
+
+  void remove(void* address) noexcept {
+    auto& s = shard_of(address);
+    std::scoped_lock lock{s.mutex};
+    s.samples.erase(address);
+  }
+
+  size_t sample_count() const {
+    size_t result = 0;
+    for (auto& s : shards) {
+      std::scoped_lock lock{s.mutex};
+      result += s.samples.size();
+    }
+    return result;
+  }
+
+  void write(std::ostream& os, profile_format format) const;
+
+ private:
+  // Every thread counts down the bytes until the next sample separately for
+  // each profiler. A countdown belongs to the profiler with the same key. The
+  // distances between samples are exponentially distributed and therefore
+  // memoryless. So a countdown that was taken over by another profiler can
+  // simply be started again without biasing the sampling.
+  struct countdown {
+    size_t key;
+    size_t bytes_until_sample;
+  };
+  static constexpr size_t countdown_count = 16;
+  struct thread_state {
+    countdown countdowns[countdown_count];
+    uint64_t random;
+    bool busy;
+  };
+  static inline thread_local thread_state state{};
+  // Keys are unique for all profilers and their sample intervals.
+  static inline std::atomic<size_t> next_key{1};
+  // Allocations of the profiler itself must not be sampled.
+  struct busy_guard {
+    busy_guard() noexcept : previous{state.busy} { state.busy = true; }
+    ~busy_guard() { state.busy = previous; }
+    bool previous;
+  };
+
+  bool should_sample_slow(countdown& c, size_t k, size_t size) noexcept;
+  size_t next_sample_distance() noexcept;
+
+  // Estimated number of allocations that are represented by one sample.
+  static double weight(size_t size, size_t interval) noexcept {
+    if (interval <= 1) return 1.0;
+    return 1.0 / -std::expm1(-double(size) / double(interval));
+  }
+
+  struct site {
+    size_t count{};
+    size_t requested{};
+    size_t granted{};
+    double estimated_requested{};
+    double estimated_granted{};
+  };
+  // Aggregate all samples with the same stack trace.
+  std::map<std::vector<void*>, site> sites() const;
+
+  // Samples are distributed over shards with their own locks. So threads
+  // that record and remove samples at the same time rarely have to wait.
+  static constexpr size_t shard_count_exp = 6;
+  static constexpr size_t shard_count = size_t{1} << shard_count_exp;
+  struct alignas(64) shard {
+    mutable std::mutex mutex{};
+    std::unordered_map<void*, sample> samples{};
+  };
+  shard& shard_of(const void* address) noexcept {
+    // Fibonacci hashing of the address. Its lowest bits are always zero.
+    const auto x = reinterpret_cast<uintptr_t>(address) >> 3;
+    return shards[(x * 0x9e3779b97f4a7c15) >> (64 - shard_count_exp)];
+  }
+
+  std::atomic<size_t> interval;
+  // The legacy format of pprof assumes a single interval for all samples.
+  // So the last interval that was used for sampling is written.
+  std::atomic<size_t> last_interval;
+  std::atomic<size_t> key{next_key.fetch_add(1, std::memory_order_relaxed)};
+  std::array<shard, shard_count> shards{};
+};
+
+inline bool heap_profiler::should_sample_slow(countdown& c, size_t k,
+                                              size_t size) noexcept {
+  auto& s = state;
+  if (s.busy || !is_sampling()) return false;
+  if (!s.random)
+    s.random = reinterpret_cast<uintptr_t>(&s) ^ 0x9e3779b97f4a7c15;
+  // A countdown of another profiler or of an old interval is started again.
+  if (c.key != k) {
+    c.key = k;
+    c.bytes_until_sample = next_sample_distance();
+    if (c.bytes_until_sample > size) {
+      c.bytes_until_sample -= size;
+      return false;
+    }
+  }
+  c.bytes_until_sample = next_sample_distance();
+  return true;
+}
+
+inline size_t heap_profiler::next_sample_distance() noexcept {
+  auto& s = state;
+  // xorshift64* generator for uniformly distributed numbers in (0, 1].
+  s.random ^= s.random >> 12;
+  s.random ^= s.random << 25;
+  s.random ^= s.random >> 27;
+  const auto bits = (s.random * 0x2545f4914f6cdd1d) >> 11;
+  const auto u = double(bits + 1) * 0x1.0p-53;
+  return size_t(-std::log(u) * double(sample_interval())) + 1;
+}
+
+inline auto heap_profiler::sites() const
+    -> std::map<std::vector<void*>, site> {
+  std::map<std::vector<void*>, site> result{};
+  for (auto& shard : shards) {
+    std::scoped_lock lock{shard.mutex};
+    for (const auto& [address, x] : shard.samples) {
+      auto& s = result[std::vector<void*>(x.frames, x.frames + x.depth)];
+      const auto w = weight(x.requested, x.interval);
+      ++s.count;
+      s.requested += x.requested;
+      s.granted += x.granted;
+      s.estimated_requested += w * double(x.requested);
+      s.estimated_granted += w * double(x.granted);
+    }
+  }
+  return result;
+}
+
+inline void heap_profiler::write(std::ostream& os,
+                                 profile_format format) const {
+  using namespace std;
+  busy_guard guard{};
+  const auto all = sites();
+  const auto rate = last_interval.load(std::memory_order_relaxed);
+
+  if (format == profile_format::pprof) {
+    // pprof scales the sampled values by itself by using the sample rate.
+    size_t count{}, bytes{};
+    for (const auto& [frames, x] : all) {
+      count += x.count;
+      bytes += x.requested;
+    }
+    os << "heap profile: " << count << ": " << bytes << " [" << count << ": "
+       << bytes << "] @ heap_v2/" << rate << '\n';
+    for (const auto& [frames, x] : all) {
+      os << x.count << ": " << x.requested << " [" << x.count << ": "
+         << x.requested << "] @";
+      for (auto f : frames) os << ' ' << f;
+      os << '\n';
+    }
+    // Needed by pprof to symbolize the addresses.
+    os << "\nMAPPED_LIBRARIES:\n";
+    ifstream maps{"/proc/self/maps"};
+    if (maps) os << maps.rdbuf();
+    return;
+  }
+
+  vector<pair<const vector<void*>*, const site*>> order{};
+  double total_requested{}, total_granted{};
+  for (const auto& [frames, x] : all) {
+    order.push_back({&frames, &x});
+    total_requested += x.estimated_requested;
+    total_granted += x.estimated_granted;
+  }
+  sort(begin(order), end(order), [](const auto& x, const auto& y) {
+    return x.second->estimated_granted > y.second->estimated_granted;
+  });
+  os << fixed << setprecision(0)
+     << "sample interval        = " << setw(20) << rate << " B" << '\n'
+     << "allocation sites       = " << setw(20) << order.size() << '\n'
+     << "estimated requested    = " << setw(20) << total_requested << " B"
+     << '\n'
+     << "estimated granted      = " << setw(20) << total_granted << " B"
+     << '\n';
+  for (const auto& [frames, x] : order) {
+    os << '\n'
+       << setw(10) << x->count << " samples" << setw(20)
+       << x->estimated_requested << " B requested" << setw(20)
+       << x->estimated_granted << " B granted" << '\n';
+#ifdef LYRAHGAMES_BUDDY_SYSTEM_BACKTRACE
+    const auto symbols = backtrace_symbols(frames->data(), frames->size());
+    for (size_t i = 0; i < frames->size(); ++i)
+      if (symbols)
+        os << "    " << symbols[i] << '\n';
+      else
+        os << "    " << (*frames)[i] << '\n';
+    std::free(symbols);
+#endif
+  }
+  os << defaultfloat;
+}
+
+}  // namespace lyrahgames::buddy_system
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+//
+#include <lyrahgames/buddy_system/arena.hpp>
+
+namespace lyrahgames::buddy_system {
+
+// The remote free queue belongs to a single owner thread that allocates memory
+// which is then deallocated by other threads, as in producer/consumer
+// pipelines. Instead of locking the arena for each deallocation, other threads
+// push the page to a lock-free list. The owner merges all pushed pages at once
+// with a single lock of the arena before its next allocation.
+class remote_free_queue {
+ public:
+  explicit remote_free_queue(arena& a) noexcept : handle{a} {}
+  ~remote_free_queue() { drain(); }
+
+  remote_free_queue(const remote_free_queue&) = delete;
+  remote_free_queue& operator=(const remote_free_queue&) = delete;
+  remote_free_queue(remote_free_queue&&) = delete;
+  remote_free_queue& operator=(remote_free_queue&&) = delete;
+
+  // Only to be called by the owner.
+  void* malloc(size_t size) noexcept {
+    if (pages.load(std::memory_order_relaxed)) drain();
+    return handle.malloc(size);
+  }
+  void free(void* address) noexcept { handle.free(address); }
+
+  // May be called by any thread. The memory must have been allocated by the
+  // arena of the queue. Invalid addresses are handled as in arena::free.
+  void push(void* address) noexcept {
+    if (!address) return;
+    size_t index;
+    const auto page = handle.validated_page(address, index);
+    // Large blocks and invalid addresses are handled by arena::free.
+    if (!page) return handle.free(address);
+    handle.forget_sample(page, address);
+    handle.push_pending_page(pages, page, index);
+  }
+
+  // Merge all pushed pages. Returns false if there was nothing to do.
+  // Normally, the owner calls this function. But it is safe for any thread.
+  bool drain() noexcept {
+    // Taking the whole list at once prevents the ABA problem.
+    const auto list = pages.exchange(nullptr, std::memory_order_acquire);
+    if (!list) return false;
+    std::scoped_lock lock{handle.mutex};
+    handle.merge_page_list(list);
+    return true;
+  }
+
+  bool empty() const noexcept {
+    return !pages.load(std::memory_order_relaxed);
+  }
+
+ private:
+  arena& handle;
+  // Other threads write to the list head. Keep it away from the owner's data.
+  alignas(64) std::atomic<arena::node*> pages{};
+};
+
+}  // namespace lyrahgames::buddy_system
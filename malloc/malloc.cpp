@@ -0,0 +1,459 @@
+// Replacement of the global memory allocation functions by buddy system
+// arenas. Compile this file as a shared library and preload it to run
+// existing binaries on top of the buddy system.
+//
+//   LD_PRELOAD=liblyrahgames-buddy-system-malloc.so <command>
+//
+// Memory is requested from the operating system in large chunks by mmap. Each
+// chunk is managed by its own arena and new chunks are added when all
+// existing arenas are exhausted. Small pages are additionally cached per
+// thread to avoid the arena lock for frequent allocations and deallocations.
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+//
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <new>
+//
+#include <lyrahgames/buddy_system/arena.hpp>
+
+namespace {
+
+using lyrahgames::buddy_system::arena;
+using lyrahgames::buddy_system::log2;
+
+// Default size of memory chunks managed by a single arena. Only virtual memory
+// is reserved. Physical memory is used when pages are touched.
+constexpr size_t chunk_size = size_t{1} << 30;
+constexpr size_t max_arenas = 256;
+// Pages up to this size are kept in thread caches after deallocation.
+constexpr size_t min_page_size_exp = 6;
+constexpr size_t max_cached_page_size_exp = 12;
+constexpr size_t cache_levels = max_cached_page_size_exp - min_page_size_exp + 1;
+constexpr size_t cache_capacity = 64;
+// Memory for allocations that happen while we are initializing ourselves or
+// constructing a new arena. Such allocations are never freed.
+constexpr size_t bootstrap_size = size_t{1} << 16;
+constexpr size_t bootstrap_alignment = arena::page_alignment;
+// Pointers returned by aligned allocations with an alignment larger than the
+// natural page alignment are shifted inside their page. The word in front of
+// such a pointer stores this marker together with the shift.
+constexpr size_t aligned_marker = 0xa119'0000'0000'0000;
+constexpr size_t aligned_marker_mask = ~size_t{0xffff'ffff'ffff};
+
+// All global state is constant-initialized to be usable before any dynamic
+// initialization of the process has taken place.
+alignas(arena) std::byte arena_storage[max_arenas][sizeof(arena)];
+std::atomic<size_t> arena_count{0};
+std::mutex growth_mutex{};
+
+alignas(bootstrap_alignment) std::byte bootstrap_buffer[bootstrap_size];
+std::atomic<size_t> bootstrap_offset{0};
+
+enum { uninitialized, initializing, initialized };
+std::atomic<int> state{uninitialized};
+pthread_key_t cache_key{};
+
+struct thread_cache {
+  void* heads[cache_levels];
+  size_t counts[cache_levels];
+  bool registered;
+};
+
+// The initial-exec model makes sure that accessing thread-local variables
+// never calls malloc itself.
+__attribute__((tls_model("initial-exec"))) thread_local thread_cache cache{};
+// Set while the current thread is inside of our own initialization or while
+// it constructs an arena. Nested allocations are then served by the bootstrap
+// buffer.
+__attribute__((tls_model("initial-exec"))) thread_local bool reentrant{};
+
+inline arena& arena_at(size_t i) noexcept {
+  return *std::launder(reinterpret_cast<arena*>(arena_storage[i]));
+}
+
+inline void* bootstrap_malloc(size_t size) noexcept {
+  // Every block stores its size in front of it to make realloc possible.
+  const auto block =
+      (size + 2 * bootstrap_alignment - 1) & ~(bootstrap_alignment - 1);
+  const auto offset = bootstrap_offset.fetch_add(block);
+  if (offset + block > bootstrap_size) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  const auto result = bootstrap_buffer + offset + bootstrap_alignment;
+  reinterpret_cast<size_t*>(result)[-1] = size;
+  return result;
+}
+
+inline bool is_bootstrap(const void* ptr) noexcept {
+  return (ptr >= bootstrap_buffer) && (ptr < bootstrap_buffer + bootstrap_size);
+}
+
+inline size_t bootstrap_usable_size(void* ptr) noexcept {
+  return reinterpret_cast<size_t*>(ptr)[-1];
+}
+
+// Construct a new arena in a newly mapped chunk that is large enough to
+// allocate the given size. The growth mutex has to be locked.
+arena* grow(size_t size) noexcept {
+  const auto n = arena_count.load(std::memory_order_relaxed);
+  if (n == max_arenas) return nullptr;
+  auto bytes = chunk_size;
+  if (n) {
+    const auto page_size = arena_at(0).page_size_for(size);
+    while (bytes < page_size) bytes <<= 1;
+  }
+  // The arena needs additional bytes to align its base pointer and to store
+  // its free page bitmaps.
+  bytes = arena::required_memory_size(bytes);
+  const auto memory =
+      mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED) return nullptr;
+  // Constructing an arena does not allocate right now. If it ever did, the
+  // nested allocation would wait for the growth mutex which we are holding.
+  // So it is served by the bootstrap buffer instead.
+  const auto outer = reentrant;
+  reentrant = true;
+  arena* result = nullptr;
+  try {
+    result = new (arena_storage[n]) arena(memory, bytes);
+  } catch (...) {
+    munmap(memory, bytes);
+  }
+  reentrant = outer;
+  if (result) arena_count.store(n + 1, std::memory_order_release);
+  return result;
+}
+
+// Fork handlers make sure that no lock is held by another thread while
+// forking. Otherwise, the child could not allocate anymore.
+void lock_all() noexcept {
+  growth_mutex.lock();
+  const auto n = arena_count.load(std::memory_order_acquire);
+  for (size_t i = 0; i < n; ++i) arena_at(i).lock();
+}
+
+void unlock_all() noexcept {
+  const auto n = arena_count.load(std::memory_order_acquire);
+  for (size_t i = n; i > 0; --i) arena_at(i - 1).unlock();
+  growth_mutex.unlock();
+}
+
+arena* arena_of(const void* ptr) noexcept {
+  const auto n = arena_count.load(std::memory_order_acquire);
+  for (size_t i = 0; i < n; ++i)
+    if (arena_at(i).contains(ptr)) return &arena_at(i);
+  return nullptr;
+}
+
+// Return the address of the page that has been allocated by the arena.
+inline void* page_address(void* ptr) noexcept {
+  const auto header = reinterpret_cast<size_t*>(ptr)[-1];
+  if ((header & aligned_marker_mask) != aligned_marker) return ptr;
+  return reinterpret_cast<std::byte*>(ptr) - (header & ~aligned_marker_mask);
+}
+
+void flush_thread_cache(void*) noexcept {
+  for (size_t i = 0; i < cache_levels; ++i) {
+    while (cache.heads[i]) {
+      const auto ptr = cache.heads[i];
+      cache.heads[i] = *reinterpret_cast<void**>(ptr);
+      arena_of(ptr)->free(ptr);
+    }
+    cache.counts[i] = 0;
+  }
+  cache.registered = false;
+}
+
+void initialize() noexcept {
+  int expected = uninitialized;
+  if (!state.compare_exchange_strong(expected, initializing)) {
+    // Another thread is initializing.
+    while (state.load(std::memory_order_acquire) != initialized) sched_yield();
+    return;
+  }
+  reentrant = true;
+  pthread_key_create(&cache_key, flush_thread_cache);
+  pthread_atfork(lock_all, unlock_all, unlock_all);
+  {
+    std::scoped_lock lock{growth_mutex};
+    grow(0);
+  }
+  reentrant = false;
+  state.store(initialized, std::memory_order_release);
+}
+
+void* buddy_malloc(size_t size) noexcept {
+  if (reentrant) return bootstrap_malloc(size);
+  if (state.load(std::memory_order_acquire) != initialized) initialize();
+  // Every successful allocation has to return a unique pointer.
+  if (!size) size = 1;
+  // Prevent overflows when adding the page header.
+  if (size > (size_t{1} << 62)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+
+  auto n = arena_count.load(std::memory_order_acquire);
+  if (!n) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+
+  const auto level = log2(arena_at(0).page_size_for(size)) - min_page_size_exp;
+  if (level < cache_levels && cache.heads[level]) {
+    const auto result = cache.heads[level];
+    cache.heads[level] = *reinterpret_cast<void**>(result);
+    --cache.counts[level];
+    return result;
+  }
+
+  for (size_t i = 0; i < n; ++i)
+    if (const auto result = arena_at(i).malloc(size)) return result;
+
+  // All arenas seem to be exhausted. Check arenas that have been added in the
+  // meantime by other threads and otherwise add a new one.
+  std::scoped_lock lock{growth_mutex};
+  for (const auto m = arena_count.load(std::memory_order_acquire); n < m; ++n)
+    if (const auto result = arena_at(n).malloc(size)) return result;
+  if (const auto a = grow(size))
+    if (const auto result = a->malloc(size)) return result;
+  errno = ENOMEM;
+  return nullptr;
+}
+
+void buddy_free(void* ptr) noexcept {
+  if (!ptr || is_bootstrap(ptr)) return;
+  const auto a = arena_of(ptr);
+  // Pointers not allocated by us are ignored.
+  if (!a) return;
+  ptr = page_address(ptr);
+
+  const auto level = log2(a->page_size(ptr)) - min_page_size_exp;
+  if (!reentrant && level < cache_levels &&
+      cache.counts[level] < cache_capacity) {
+    // The destructor of the key will flush the cache when the thread exits.
+    if (!cache.registered) {
+      cache.registered = true;
+      pthread_setspecific(cache_key, &cache);
+    }
+    *reinterpret_cast<void**>(ptr) = cache.heads[level];
+    cache.heads[level] = ptr;
+    ++cache.counts[level];
+    return;
+  }
+  a->free(ptr);
+}
+
+size_t buddy_usable_size(void* ptr) noexcept {
+  if (!ptr) return 0;
+  if (is_bootstrap(ptr)) return bootstrap_usable_size(ptr);
+  const auto a = arena_of(ptr);
+  if (!a) return 0;
+  const auto page = page_address(ptr);
+  return a->usable_size(page) - static_cast<size_t>(
+                                    reinterpret_cast<std::byte*>(ptr) -
+                                    reinterpret_cast<std::byte*>(page));
+}
+
+void* buddy_aligned_malloc(size_t alignment, size_t size) noexcept {
+  // Every page is naturally aligned to the page alignment.
+  if (alignment <= arena::page_alignment) return buddy_malloc(size);
+  if (size > (size_t{1} << 62) || alignment > (size_t{1} << 47)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  // Otherwise, allocate enough memory to shift the pointer to the next aligned
+  // address. The shift is at least the page alignment and leaves enough space
+  // to store the marker in front of the returned pointer.
+  const auto page = buddy_malloc(size + alignment);
+  if (!page || is_bootstrap(page)) return page;
+  const auto address = reinterpret_cast<uintptr_t>(page);
+  const auto result = (address + alignment) & ~(alignment - 1);
+  reinterpret_cast<size_t*>(result)[-1] = aligned_marker | (result - address);
+  return reinterpret_cast<void*>(result);
+}
+
+void* buddy_realloc(void* ptr, size_t size) noexcept {
+  if (!ptr) return buddy_malloc(size);
+  if (!size) {
+    buddy_free(ptr);
+    return nullptr;
+  }
+  const auto usable = buddy_usable_size(ptr);
+  if (size <= usable && !is_bootstrap(ptr)) return ptr;
+  const auto result = buddy_malloc(size);
+  if (!result) return nullptr;
+  std::memcpy(result, ptr, std::min(size, usable));
+  buddy_free(ptr);
+  return result;
+}
+
+inline bool is_power_of_two(size_t x) noexcept { return x && !(x & (x - 1)); }
+
+void* throwing_malloc(size_t size, size_t alignment = 0) {
+  for (;;) {
+    const auto result = alignment ? buddy_aligned_malloc(alignment, size)
+                                  : buddy_malloc(size);
+    if (result) return result;
+    const auto handler = std::get_new_handler();
+    if (!handler) throw std::bad_alloc{};
+    handler();
+  }
+}
+
+}  // namespace
+
+extern "C" {
+
+__attribute__((visibility("default"))) void* malloc(size_t size) {
+  return buddy_malloc(size);
+}
+
+__attribute__((visibility("default"))) void free(void* ptr) {
+  buddy_free(ptr);
+}
+
+__attribute__((visibility("default"))) void* calloc(size_t n, size_t size) {
+  size_t bytes;
+  if (__builtin_mul_overflow(n, size, &bytes)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  const auto result = buddy_malloc(bytes);
+  if (result) std::memset(result, 0, bytes);
+  return result;
+}
+
+__attribute__((visibility("default"))) void* realloc(void* ptr, size_t size) {
+  return buddy_realloc(ptr, size);
+}
+
+__attribute__((visibility("default"))) int posix_memalign(void** ptr,
+                                                          size_t alignment,
+                                                          size_t size) {
+  if (!is_power_of_two(alignment) || (alignment % sizeof(void*))) return EINVAL;
+  const auto result = buddy_aligned_malloc(alignment, size);
+  if (!result) return ENOMEM;
+  *ptr = result;
+  return 0;
+}
+
+__attribute__((visibility("default"))) void* aligned_alloc(size_t alignment,
+                                                           size_t size) {
+  if (!is_power_of_two(alignment)) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  return buddy_aligned_malloc(alignment, size);
+}
+
+__attribute__((visibility("default"))) void* memalign(size_t alignment,
+                                                      size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+__attribute__((visibility("default"))) void* valloc(size_t size) {
+  return buddy_aligned_malloc(4096, size);
+}
+
+__attribute__((visibility("default"))) size_t malloc_usable_size(void* ptr) {
+  return buddy_usable_size(ptr);
+}
+
+}  // extern "C"
+
+__attribute__((visibility("default"))) void* operator new(size_t size) {
+  return throwing_malloc(size);
+}
+
+__attribute__((visibility("default"))) void* operator new[](size_t size) {
+  return throwing_malloc(size);
+}
+
+__attribute__((visibility("default"))) void* operator new(
+    size_t size, const std::nothrow_t&) noexcept {
+  return buddy_malloc(size);
+}
+
+__attribute__((visibility("default"))) void* operator new[](
+    size_t size, const std::nothrow_t&) noexcept {
+  return buddy_malloc(size);
+}
+
+__attribute__((visibility("default"))) void* operator new(
+    size_t size, std::align_val_t alignment) {
+  return throwing_malloc(size, static_cast<size_t>(alignment));
+}
+
+__attribute__((visibility("default"))) void* operator new[](
+    size_t size, std::align_val_t alignment) {
+  return throwing_malloc(size, static_cast<size_t>(alignment));
+}
+
+__attribute__((visibility("default"))) void* operator new(
+    size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return buddy_aligned_malloc(static_cast<size_t>(alignment), size);
+}
+
+__attribute__((visibility("default"))) void* operator new[](
+    size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return buddy_aligned_malloc(static_cast<size_t>(alignment), size);
+}
+
+__attribute__((visibility("default"))) void operator delete(void* ptr) noexcept {
+  buddy_free(ptr);
+}
+
+__attribute__((visibility("default"))) void operator delete[](
+    void* ptr) noexcept {
+  buddy_free(ptr);
+}
+
+__attribute__((visibility("default"))) void operator delete(void* ptr,
+                                                            size_t) noexcept {
+  buddy_free(ptr);
+}
+
+__attribute__((visibility("default"))) void operator delete[](
+    void* ptr, size_t) noexcept {
+  buddy_free(ptr);
+}
+
+__attribute__((visibility("default"))) void operator delete(
+    void* ptr, std::align_val_t) noexcept {
+  buddy_free(ptr);
+}
+
+__attribute__((visibility("default"))) void operator delete[](
+    void* ptr, std::align_val_t) noexcept {
+  buddy_free(ptr);
+}
+
+__attribute__((visibility("default"))) void operator delete(
+    void* ptr, size_t, std::align_val_t) noexcept {
+  buddy_free(ptr);
+}
+
+__attribute__((visibility("default"))) void operator delete[](
+    void* ptr, size_t, std::align_val_t) noexcept {
+  buddy_free(ptr);
+}
+
+__attribute__((visibility("default"))) void operator delete(
+    void* ptr, const std::nothrow_t&) noexcept {
+  buddy_free(ptr);
+}
+
+__attribute__((visibility("default"))) void operator delete[](
+    void* ptr, const std::nothrow_t&) noexcept {
+  buddy_free(ptr);
+}
@@ -0,0 +1,122 @@
+// Test of the replacement of malloc. The path of the shared library is given
+// as the only argument. The process restarts itself with the library preloaded
+// and runs a multithreaded workload which also forks.
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+//
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#define CHECK(condition)                                                  \
+  do {                                                                    \
+    if (!(condition)) {                                                   \
+      cerr << __FILE__ << ':' << __LINE__ << ": check failed: " #condition \
+           << endl;                                                       \
+      abort();                                                            \
+    }                                                                     \
+  } while (false)
+
+namespace {
+
+bool aligned(const void* ptr, size_t alignment) {
+  return !(reinterpret_cast<uintptr_t>(ptr) % alignment);
+}
+
+bool filled(const void* ptr, size_t size, unsigned char pattern) {
+  const auto bytes = static_cast<const unsigned char*>(ptr);
+  for (size_t i = 0; i < size; ++i)
+    if (bytes[i] != pattern) return false;
+  return true;
+}
+
+// The symbol malloc has to be resolved to the preloaded library.
+void check_replacement() {
+  Dl_info info{};
+  CHECK(dladdr(dlsym(RTLD_DEFAULT, "malloc"), &info));
+  CHECK(info.dli_fname);
+  CHECK(strstr(info.dli_fname, "lyrahgames-buddy-system-malloc"));
+}
+
+void workload(unsigned seed) {
+  mt19937 rng{seed};
+  map<int, string> strings{};
+  for (int i = 0; i < 20'000; ++i) {
+    strings[int(rng() % 1000)] = string(rng() % 300, 'x');
+
+    const auto alignment = size_t{8} << (rng() % 10);
+    void* p = nullptr;
+    CHECK(!posix_memalign(&p, alignment, 100));
+    CHECK(aligned(p, alignment));
+    memset(p, 0x5a, 100);
+    // Growing and shrinking has to keep the content.
+    p = realloc(p, 1 + rng() % 10'000);
+    CHECK(p);
+    CHECK(filled(p, min(malloc_usable_size(p), size_t{100}), 0x5a));
+    p = realloc(p, 10);
+    CHECK(p && filled(p, 10, 0x5a));
+    free(p);
+
+    const auto q = static_cast<unsigned char*>(calloc(1 + rng() % 100, 64));
+    CHECK(q && filled(q, 64, 0));
+    free(q);
+  }
+}
+
+// Fork while other threads allocate. The child must be able to allocate
+// memory even if another thread held a lock of the allocator during fork.
+void check_fork(atomic<bool>& done) {
+  while (!done.load()) {
+    const auto pid = fork();
+    CHECK(pid >= 0);
+    if (!pid) {
+      vector<string> strings(1000, string(100, 'y'));
+      free(malloc(1 << 20));
+      _exit(strings.back().size() == 100 ? 0 : 1);
+    }
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && !WEXITSTATUS(status));
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    cerr << "usage: " << argv[0] << " <library>" << endl;
+    return 1;
+  }
+  const auto preloaded = getenv("LD_PRELOAD");
+  if (!preloaded || strcmp(preloaded, argv[1])) {
+    setenv("LD_PRELOAD", argv[1], 1);
+    execv("/proc/self/exe", argv);
+    CHECK(false);
+  }
+  check_replacement();
+
+  atomic<bool> done{false};
+  thread forker{[&] { check_fork(done); }};
+  vector<thread> threads{};
+  for (unsigned i = 0; i < 8; ++i) threads.emplace_back(workload, i);
+  for (auto& t : threads) t.join();
+  done = true;
+  forker.join();
+
+  // Blocks larger than the chunk of a single arena.
+  const auto large = malloc(size_t{3} << 30);
+  CHECK(large);
+  free(large);
+}
@@ -1,3 +1,635 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+//
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+//
 #include <lyrahgames/buddy_system/buddy_system.hpp>
 
-int main() {}
\ No newline at end of file
+using namespace std;
+using namespace lyrahgames;
+
+#define CHECK(condition)                                                  \
+  do {                                                                    \
+    if (!(condition)) {                                                   \
+      cerr << __FILE__ << ':' << __LINE__ << ": check failed: " #condition \
+           << endl;                                                       \
+      abort();                                                            \
+    }                                                                     \
+  } while (false)
+
+namespace {
+
+// Shadow model of a single allocation. Every allocation is filled with its own
+// pattern, so corrupted or overlapping allocations are detected when the
+// pattern is checked again.
+struct allocation {
+  unsigned char* data;
+  size_t size;
+  unsigned char pattern;
+};
+
+void fill(const allocation& a) { memset(a.data, a.pattern, a.size); }
+
+bool intact(const allocation& a) {
+  return all_of(a.data, a.data + a.size,
+                [&](auto x) { return x == a.pattern; });
+}
+
+// The arena does not provide realloc. Shrinking stays in place. Growing always
+// moves the allocation because address sanitizers only unpoison the requested
+// size and not the whole usable size of the page.
+void* reallocate(buddy_system::arena& arena, void* ptr, size_t old_size,
+                 size_t size) {
+  if (size <= old_size) return ptr;
+  const auto result = arena.malloc(size);
+  if (!result) return nullptr;
+  memcpy(result, ptr, old_size);
+  arena.free(ptr);
+  return result;
+}
+
+size_t random_size(mt19937& rng) {
+  // Prefer small sizes but also allocate large pages from time to time.
+  uniform_int_distribution<int> exp_dist{0, 16};
+  const auto exp = min(exp_dist(rng), exp_dist(rng));
+  return uniform_int_distribution<size_t>{1, size_t{1} << (exp + 4)}(rng);
+}
+
+// Run random malloc, free and realloc operations and keep the shadow model
+// up to date. The function can run concurrently in several threads.
+void random_operations(buddy_system::arena& arena, vector<allocation>& live,
+                       size_t operations, unsigned seed) {
+  mt19937 rng{seed};
+  for (size_t i = 0; i < operations; ++i) {
+    const auto op = rng() % 8;
+    if (live.empty() || op < 4) {
+      const auto size = random_size(rng);
+      const auto p = arena.malloc(size);
+      if (!p) continue;
+      CHECK(arena.is_valid(p));
+      CHECK(arena.usable_size(p) >= size);
+      CHECK(reinterpret_cast<uintptr_t>(p) % arena.page_alignment == 0);
+      live.push_back({static_cast<unsigned char*>(p), size,
+                      static_cast<unsigned char>(rng())});
+      fill(live.back());
+    } else if (op < 7) {
+      const auto index = rng() % live.size();
+      CHECK(intact(live[index]));
+      arena.free(live[index].data);
+      live[index] = live.back();
+      live.pop_back();
+    } else {
+      auto& a = live[rng() % live.size()];
+      CHECK(intact(a));
+      const auto size = random_size(rng);
+      const auto p = reallocate(arena, a.data, a.size, size);
+      if (!p) continue;
+      a.data = static_cast<unsigned char*>(p);
+      CHECK(all_of(a.data, a.data + min(a.size, size),
+                   [&](auto x) { return x == a.pattern; }));
+      a.size = size;
+      fill(a);
+    }
+  }
+}
+
+// Live allocations of different threads must never overlap.
+void check_disjoint(vector<allocation> live) {
+  sort(begin(live), end(live),
+       [](const auto& x, const auto& y) { return x.data < y.data; });
+  for (size_t i = 1; i < live.size(); ++i)
+    CHECK(live[i - 1].data + live[i - 1].size <= live[i].data);
+  for (const auto& a : live) CHECK(intact(a));
+}
+
+void free_all(buddy_system::arena& arena, const vector<allocation>& live) {
+  for (const auto& a : live) {
+    CHECK(intact(a));
+    arena.free(a.data);
+  }
+}
+
+// After freeing everything, all buddies have to be merged again.
+void check_empty(const buddy_system::arena& arena) {
+  CHECK(arena.check_invariants());
+  CHECK(arena.available_memory_size() == arena.managed_memory_size());
+  CHECK(arena.max_available_page_size() == arena.managed_memory_size());
+}
+
+void test_single_thread() {
+  buddy_system::arena arena{size_t{1} << 24};
+  check_empty(arena);
+  vector<allocation> live{};
+  for (unsigned round = 0; round < 20; ++round) {
+    random_operations(arena, live, 5'000, round);
+    CHECK(arena.check_invariants());
+    check_disjoint(live);
+  }
+  free_all(arena, live);
+  check_empty(arena);
+}
+
+void test_exhaustion() {
+  buddy_system::arena arena{size_t{1} << 20};
+  vector<allocation> live{};
+  mt19937 rng{7};
+  // Fill the arena completely with randomly sized pages.
+  for (size_t failures = 0; failures < 100;) {
+    const auto size = random_size(rng);
+    const auto p = arena.malloc(size);
+    if (!p) {
+      ++failures;
+      CHECK(arena.max_available_page_size() < arena.page_size_for(size));
+      continue;
+    }
+    live.push_back({static_cast<unsigned char*>(p), size, 0x5a});
+    fill(live.back());
+  }
+  CHECK(arena.check_invariants());
+  check_disjoint(live);
+  // Free every second allocation and fill the gaps again.
+  for (size_t i = 0; i < live.size(); i += 2) arena.free(live[i].data);
+  CHECK(arena.check_invariants());
+  for (size_t i = 0; i < live.size(); i += 2) {
+    const auto p = arena.malloc(live[i].size);
+    CHECK(p);
+    live[i].data = static_cast<unsigned char*>(p);
+    fill(live[i]);
+  }
+  CHECK(arena.check_invariants());
+  check_disjoint(live);
+  free_all(arena, live);
+  check_empty(arena);
+}
+
+void test_multiple_threads() {
+  constexpr size_t thread_count = 8;
+  constexpr size_t operations = 20'000;
+  buddy_system::arena arena{size_t{1} << 28};
+
+  vector<vector<allocation>> live(thread_count);
+  // Pages handed over to be freed by another thread.
+  mutex exchange_mutex{};
+  vector<allocation> exchange{};
+  atomic<bool> done{};
+
+  // The checker verifies the structure while the workers are running.
+  thread checker{[&] {
+    while (!done.load()) CHECK(arena.check_invariants());
+  }};
+
+  vector<thread> workers{};
+  for (size_t t = 0; t < thread_count; ++t) {
+    workers.emplace_back([&, t] {
+      auto& own = live[t];
+      for (unsigned round = 0; round < 10; ++round) {
+        random_operations(arena, own, operations / 10,
+                          unsigned(t * 1000 + round));
+        // Give some allocations to other threads and free theirs.
+        scoped_lock lock{exchange_mutex};
+        for (auto n = own.size() / 8; n > 0; --n) {
+          exchange.push_back(own.back());
+          own.pop_back();
+        }
+        for (auto n = exchange.size() / 2; n > 0; --n) {
+          CHECK(intact(exchange.back()));
+          arena.free(exchange.back().data);
+          exchange.pop_back();
+        }
+      }
+    });
+  }
+  for (auto& w : workers) w.join();
+  done = true;
+  checker.join();
+
+  vector<allocation> all{exchange};
+  for (const auto& own : live) all.insert(end(all), begin(own), end(own));
+  CHECK(arena.check_invariants());
+  check_disjoint(all);
+  free_all(arena, all);
+  check_empty(arena);
+}
+
+void test_deferred_free() {
+  constexpr size_t thread_count = 4;
+  buddy_system::arena arena{size_t{1} << 26};
+  vector<vector<allocation>> live(thread_count);
+  {
+    buddy_system::maintenance_thread maintenance{arena};
+    vector<thread> workers{};
+    for (size_t t = 0; t < thread_count; ++t)
+      workers.emplace_back([&, t] {
+        random_operations(arena, live[t], 20'000, unsigned(t + 100));
+      });
+    for (auto& w : workers) w.join();
+    // Pending pages are part of the allocated memory.
+    CHECK(arena.check_invariants());
+    for (const auto& own : live) free_all(arena, own);
+  }
+  // The maintenance thread merges all pending pages on destruction.
+  check_empty(arena);
+}
+
+// With a tiny time budget, maintenance needs many calls to merge and purge
+// all freed pages. In between, the arena has to stay consistent and still
+// serve allocations.
+void test_maintain() {
+  buddy_system::arena arena{size_t{1} << 26};
+  vector<allocation> live{};
+  // Touch several chunks that are large enough to be purged.
+  for (size_t i = 0; i < 8; ++i) {
+    const auto size = size_t{3} << 20;
+    const auto p = arena.malloc(size);
+    CHECK(p);
+    live.push_back({static_cast<unsigned char*>(p), size,
+                    static_cast<unsigned char>(i)});
+    fill(live.back());
+  }
+  random_operations(arena, live, 20'000, 7);
+  arena.set_deferred_free(true);
+  vector<allocation> kept{};
+  for (size_t i = 0; i < live.size(); ++i) {
+    if (i % 4)
+      arena.free(live[i].data);
+    else
+      kept.push_back(live[i]);
+  }
+  size_t calls = 0;
+  while (arena.maintain(chrono::nanoseconds{1})) {
+    ++calls;
+    CHECK(arena.check_invariants());
+    const auto p = arena.malloc(100);
+    CHECK(p);
+    kept.push_back({static_cast<unsigned char*>(p), 100,
+                    static_cast<unsigned char>(calls)});
+    fill(kept.back());
+  }
+  CHECK(calls > 1);
+  arena.set_deferred_free(false);
+  check_disjoint(kept);
+  free_all(arena, kept);
+  while (arena.maintain(chrono::nanoseconds{1})) continue;
+  check_empty(arena);
+}
+
+// While another thread purges a free page without holding the lock, an
+// allocation that needs this page has to wait for it instead of failing.
+void test_concurrent_purge() {
+  buddy_system::arena arena{size_t{1} << 27};
+  atomic<bool> done{};
+  thread maintenance{[&] {
+    while (!done.load(memory_order_relaxed))
+      arena.maintain(chrono::seconds{10});
+  }};
+  for (size_t i = 0; i < 8; ++i) {
+    // Touch a large part of the memory. Purging it takes a while.
+    constexpr size_t size = size_t{1} << 26;
+    const auto p = static_cast<unsigned char*>(arena.malloc(size));
+    CHECK(p);
+    for (size_t j = 0; j < size; j += 4096)
+      p[j] = static_cast<unsigned char>(i);
+    arena.free(p);
+    // Give the other thread the chance to start purging.
+    this_thread::sleep_for(chrono::milliseconds{1});
+    for (size_t j = 0; j < 2'000; ++j) {
+      const auto q = arena.malloc(size_t{1} << 20);
+      CHECK(q);
+      arena.free(q);
+    }
+  }
+  done = true;
+  maintenance.join();
+  check_empty(arena);
+}
+
+void test_remote_free() {
+  constexpr size_t pair_count = 4;
+  constexpr size_t message_count = 20'000;
+  buddy_system::arena arena{size_t{1} << 26};
+  {
+    vector<unique_ptr<buddy_system::remote_free_queue>> owners{};
+    for (size_t i = 0; i < pair_count; ++i)
+      owners.push_back(make_unique<buddy_system::remote_free_queue>(arena));
+    // Producers allocate messages and consumers free them remotely.
+    mutex exchange_mutex{};
+    vector<allocation> exchange{};
+    vector<thread> threads{};
+    for (size_t i = 0; i < pair_count; ++i) {
+      threads.emplace_back([&, i] {
+        mt19937 rng{unsigned(i)};
+        for (size_t j = 0; j < message_count; ++j) {
+          const auto size = random_size(rng);
+          const auto p = owners[i]->malloc(size);
+          if (!p) continue;
+          allocation a{static_cast<unsigned char*>(p), size,
+                       static_cast<unsigned char>(j)};
+          fill(a);
+          scoped_lock lock{exchange_mutex};
+          exchange.push_back(a);
+        }
+      });
+      threads.emplace_back([&, i] {
+        for (size_t j = 0; j < message_count / 2; ++j) {
+          allocation a;
+          {
+            scoped_lock lock{exchange_mutex};
+            if (exchange.empty()) continue;
+            a = exchange.back();
+            exchange.pop_back();
+          }
+          CHECK(intact(a));
+          // Frees of other producers are allowed as well.
+          owners[(i + j) % pair_count]->push(a.data);
+        }
+      });
+    }
+    for (auto& t : threads) t.join();
+    // Pushed pages are still allocated until their owner drains the queue.
+    CHECK(arena.check_invariants());
+    for (const auto& owner : owners) {
+      owner->drain();
+      CHECK(owner->empty());
+    }
+    CHECK(arena.check_invariants());
+    check_disjoint(exchange);
+    for (const auto& a : exchange) owners[0]->push(a.data);
+  }
+  // Queues drain their remaining pages on destruction.
+  check_empty(arena);
+}
+
+// Number of samples and sampled bytes from the header of a pprof profile.
+pair<size_t, size_t> profile_summary(const buddy_system::arena& arena) {
+  stringstream stream{};
+  arena.write_heap_profile(stream);
+  string heap, profile;
+  size_t count, bytes;
+  char colon;
+  stream >> heap >> profile >> count >> colon >> bytes;
+  CHECK(heap == "heap" && profile == "profile:");
+  return {count, bytes};
+}
+
+// Estimated amount of live requested bytes from the text format.
+double estimated_requested(const buddy_system::arena& arena) {
+  stringstream stream{};
+  arena.write_heap_profile(stream, buddy_system::profile_format::text);
+  const auto text = stream.str();
+  const string label = "estimated requested    =";
+  const auto position = text.find(label);
+  CHECK(position != string::npos);
+  return stod(text.substr(position + label.size()));
+}
+
+void test_profiler() {
+  buddy_system::arena arena{size_t{1} << 24};
+  CHECK(!arena.is_profiling());
+  CHECK(profile_summary(arena) == make_pair(size_t{0}, size_t{0}));
+  // Sample every allocation.
+  arena.start_profiling(1);
+  CHECK(arena.is_profiling());
+  vector<void*> pointers{};
+  for (size_t i = 0; i < 100; ++i) pointers.push_back(arena.malloc(100));
+  CHECK(profile_summary(arena) == make_pair(size_t{100}, size_t{10'000}));
+  CHECK(arena.check_invariants());
+  // Sampled pages stay valid and forget their samples when freed.
+  for (size_t i = 0; i < 50; ++i) {
+    CHECK(arena.is_valid(pointers.back()));
+    arena.free(pointers.back());
+    pointers.pop_back();
+  }
+  CHECK(profile_summary(arena) == make_pair(size_t{50}, size_t{5'000}));
+  // Objects of pools are sampled per slot. Pool pages are not sampled.
+  {
+    buddy_system::arena objects_arena{size_t{1} << 20};
+    objects_arena.start_profiling(1);
+    vector<void*> objects{};
+    for (size_t i = 0; i < 100; ++i)
+      objects.push_back(objects_arena.malloc_object<24, 8>());
+    CHECK(profile_summary(objects_arena) ==
+          make_pair(size_t{100}, size_t{2'400}));
+    for (auto p : objects) objects_arena.free_object<24, 8>(p);
+    CHECK(profile_summary(objects_arena) ==
+          make_pair(size_t{0}, size_t{0}));
+    CHECK(objects_arena.check_invariants());
+  }
+  // Stopping keeps the samples of live allocations and their interval.
+  arena.stop_profiling();
+  CHECK(!arena.is_profiling());
+  stringstream header{};
+  arena.write_heap_profile(header);
+  CHECK(header.str().find("@ heap_v2/1\n") != string::npos);
+  for (size_t i = 0; i < 50; ++i) pointers.push_back(arena.malloc(100));
+  CHECK(profile_summary(arena) == make_pair(size_t{50}, size_t{5'000}));
+  stringstream text{};
+  arena.write_heap_profile(text, buddy_system::profile_format::text);
+  CHECK(text.str().find("allocation sites") != string::npos);
+  for (auto p : pointers) arena.free(p);
+  CHECK(profile_summary(arena) == make_pair(size_t{0}, size_t{0}));
+  check_empty(arena);
+}
+
+// Two arenas with different sample intervals are used at the same time. Each
+// profile has to estimate the live memory of its own arena, also after the
+// profiling has been stopped.
+void test_profiler_estimates() {
+  constexpr size_t count = 20'000;
+  constexpr size_t size = 1000;
+  buddy_system::arena fine{size_t{1} << 25};
+  buddy_system::arena coarse{size_t{1} << 25};
+  fine.start_profiling(size_t{1} << 14);
+  coarse.start_profiling(size_t{1} << 24);
+  vector<void*> fine_pointers{};
+  vector<void*> coarse_pointers{};
+  for (size_t i = 0; i < count; ++i) {
+    fine_pointers.push_back(fine.malloc(size));
+    coarse_pointers.push_back(coarse.malloc(size));
+  }
+  // About 1200 samples give a standard error of about 3 %.
+  const auto estimate = estimated_requested(fine);
+  CHECK(abs(estimate - double(count * size)) < 0.15 * double(count * size));
+  fine.stop_profiling();
+  coarse.stop_profiling();
+  CHECK(estimated_requested(fine) == estimate);
+  for (auto p : fine_pointers) fine.free(p);
+  for (auto p : coarse_pointers) coarse.free(p);
+  check_empty(fine);
+  check_empty(coarse);
+}
+
+void test_large_allocations() {
+  buddy_system::arena arena{size_t{1} << 24};
+  arena.set_large_allocation_threshold(size_t{1} << 20);
+  CHECK(arena.large_allocation_threshold() == size_t{1} << 20);
+  // Small allocations still use the buddy system.
+  const auto small = arena.malloc(1000);
+  CHECK(arena.contains(small));
+  // A block of 3 MiB would need a page of 4 MiB in the buddy system. Blocks
+  // larger than the managed memory are possible as well.
+  vector<allocation> live{};
+  for (auto size : {(size_t{3} << 20) + 5, size_t{1} << 25}) {
+    const auto p = arena.malloc(size);
+    CHECK(p);
+    CHECK(!arena.contains(p));
+    CHECK(arena.is_valid(p));
+    CHECK(arena.page_size(p) >= size);
+    CHECK(arena.page_size(p) < size + 65536);
+    CHECK(arena.usable_size(p) == arena.page_size(p));
+    live.push_back({static_cast<unsigned char*>(p), size, 0x3c});
+    fill(live.back());
+  }
+  CHECK(arena.check_invariants());
+  CHECK(arena.available_memory_size() ==
+        arena.managed_memory_size() - arena.page_size(small));
+  check_disjoint(live);
+  free_all(arena, live);
+  for (const auto& a : live) CHECK(!arena.is_valid(a.data));
+  arena.free(small);
+  check_empty(arena);
+}
+
+void test_allocator() {
+  buddy_system::arena arena{size_t{1} << 24};
+  {
+    list<int, buddy_system::allocator<int>> l{arena};
+    map<int, int, less<int>, buddy_system::allocator<pair<const int, int>>> m{
+        arena};
+    vector<int, buddy_system::allocator<int>> v{arena};
+    for (int i = 0; i < 10'000; ++i) {
+      l.push_back(i);
+      m.emplace(i, i);
+      v.push_back(i);
+    }
+    CHECK(arena.check_invariants());
+    for (int i = 0; i < 10'000; i += 2) m.erase(i);
+    l.clear();
+    CHECK(arena.check_invariants());
+    CHECK(m.size() == 5'000);
+    CHECK(v.size() == 10'000);
+  }
+  CHECK(arena.check_invariants());
+  // Pool pages without live objects are given back by maintain.
+  while (arena.maintain(chrono::nanoseconds{1})) continue;
+  check_empty(arena);
+
+  // A failing allocation releases empty pool pages itself.
+  buddy_system::arena small_arena{size_t{1} << 20};
+  {
+    list<int, buddy_system::allocator<int>> l{small_arena};
+    for (int i = 0; i < 10'000; ++i) l.push_back(i);
+  }
+  // The hardened mode does not use pools.
+  CHECK(buddy_system::hardened || (small_arena.available_memory_size() <
+                                    small_arena.managed_memory_size()));
+  const auto p = small_arena.malloc(size_t{1} << 19);
+  CHECK(p);
+  small_arena.free(p);
+  check_empty(small_arena);
+
+  // In tiny arenas, pool pages have the smallest page size. Each of the two
+  // pages of this arena provides seven slots.
+  buddy_system::arena tiny_arena{128};
+  vector<void*> objects{};
+  while (const auto p = tiny_arena.malloc_object<8, 8>()) objects.push_back(p);
+  CHECK(objects.size() == (buddy_system::hardened ? 2 : 14));
+  for (auto p : objects) tiny_arena.free_object<8, 8>(p);
+  // Larger objects do not fit into such a page and use usual pages instead.
+  // Their allocation has to release the empty pool pages first.
+  const auto object = tiny_arena.malloc_object<64, 8>();
+  CHECK(object);
+  CHECK(tiny_arena.is_valid(object));
+  tiny_arena.free_object<64, 8>(object);
+  check_empty(tiny_arena);
+}
+
+// Run the given function in a child process which has to be aborted by the
+// report of a memory error with the given message and address.
+template <typename function>
+void check_memory_error(function f, const string& message,
+                        const void* address) {
+  int pipe_ends[2];
+  CHECK(pipe(pipe_ends) == 0);
+  const auto pid = fork();
+  CHECK(pid >= 0);
+  if (!pid) {
+    dup2(pipe_ends[1], STDERR_FILENO);
+    close(pipe_ends[0]);
+    close(pipe_ends[1]);
+    f();
+    _exit(0);
+  }
+  close(pipe_ends[1]);
+  string report{};
+  char buffer[256];
+  for (ssize_t n; (n = read(pipe_ends[0], buffer, sizeof(buffer))) > 0;)
+    report.append(buffer, size_t(n));
+  close(pipe_ends[0]);
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFSIGNALED(status) && (WTERMSIG(status) == SIGABRT));
+  ostringstream expected{};
+  expected << "address = " << address;
+  CHECK(report.find("lyrahgames::buddy_system: " + message) != string::npos);
+  CHECK(report.find(expected.str()) != string::npos);
+}
+
+// Only the hardened mode reports memory errors. Otherwise, invalid frees are
+// ignored and buffer overflows are not detected.
+void test_memory_errors() {
+  if constexpr (buddy_system::hardened) {
+    buddy_system::arena arena{size_t{1} << 20};
+    const auto p = static_cast<unsigned char*>(arena.malloc(100));
+    CHECK(p);
+    check_memory_error(
+        [&] {
+          arena.free(p);
+          arena.free(p);
+        },
+        "double free", p);
+    check_memory_error([&] { arena.free(p + 3); }, "invalid free", p + 3);
+    check_memory_error(
+        [&] {
+          // Write past the usable size without being stopped by sanitizers.
+          const auto end = p + arena.usable_size(p);
+          buddy_system::unpoison_memory_region(end, 1);
+          *end = 0;
+          arena.free(p);
+        },
+        "buffer overflow detected at end of page", p);
+    // The child processes did not change the memory of this process.
+    arena.free(p);
+    check_empty(arena);
+  }
+}
+
+}  // namespace
+
+int main() {
+  test_single_thread();
+  test_exhaustion();
+  test_multiple_threads();
+  test_deferred_free();
+  test_maintain();
+  test_concurrent_purge();
+  test_remote_free();
+  test_profiler();
+  test_profiler_estimates();
+  test_large_allocations();
+  test_allocator();
+  test_memory_errors();
+}